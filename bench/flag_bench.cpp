@@ -0,0 +1,239 @@
+/*
+ * =============================================================================
+ *  File Name    : flag_bench.cpp
+ *  Description  : Lightweight flag parsing utility for C++ (command-line flags)
+ *  Author       : Ouzw
+ *  Email        : ouzw.mail@gmail.com
+ *  Created Date : Mon Oct 19 10:12:31 2026 +0800
+ *  Version      : 1.0
+ *
+ *  Copyright (c) 2025 Ouzw
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ * =============================================================================
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cxx_opt.h"
+
+#ifndef _WIN32
+#include <getopt.h>
+#endif
+
+template <typename Fn>
+static double elapsedMs(Fn &&fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static std::vector<unsigned> threadCounts() {
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < hardware && n <= 16; n *= 2)
+        counts.push_back(n);
+    counts.push_back(hardware);
+    return counts;
+}
+
+/*
+ * N plugins register their flags in parallel into one Flag, against the same
+ * plugins serialized behind one global mutex.
+ */
+static void benchRegister() {
+    const size_t total = 1 << 16;
+
+    std::vector<std::string> names(total);
+    std::vector<int> values(total);
+    for (size_t i = 0; i < total; i++)
+        names[i] = "plugin.flag_" + std::to_string(i);
+
+    std::printf("register %zu flags\n", total);
+    for (unsigned threads : threadCounts()) {
+        auto run = [&](std::mutex *global) {
+            CXX_OPT_NAMESPACE::Flag flag;
+            std::vector<std::thread> workers;
+            return elapsedMs([&]() {
+                for (unsigned t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t]() {
+                        for (size_t i = t; i < total; i += threads) {
+                            if (global != nullptr) {
+                                std::lock_guard<std::mutex> lock(*global);
+                                flag.registerInt(names[i], &values[i]);
+                            } else {
+                                flag.registerInt(names[i], &values[i]);
+                            }
+                        }
+                    });
+                }
+                for (auto &worker : workers)
+                    worker.join();
+            });
+        };
+
+        std::mutex global;
+        double serialized = run(&global);
+        double sharded = run(nullptr);
+        std::printf("  threads %2u: global mutex %8.2f ms, sharded %8.2f ms\n", threads, serialized, sharded);
+    }
+}
+
+/*
+ * parse of a long command line against a large registry, lookups take no lock.
+ */
+static void benchLookup() {
+    const size_t flags = 5000;
+    const size_t tokens = 200000;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::vector<int> values(flags);
+    for (size_t i = 0; i < flags; i++)
+        flag.registerInt("plugin.flag_" + std::to_string(i), &values[i]);
+
+    std::vector<std::string> storage;
+    storage.reserve(tokens);
+    for (size_t i = 0; i < tokens; i++)
+        storage.push_back("--plugin.flag_" + std::to_string(i * 7919 % flags) + "=" + std::to_string(i));
+    std::vector<char *> argv;
+    argv.push_back((char *)"bench");
+    for (auto &token : storage)
+        argv.push_back(&token[0]);
+
+    double ms = elapsedMs([&]() { flag.parse(static_cast<int>(argv.size()), argv.data()); });
+    std::printf("parse %zu tokens, %zu flags: %8.2f ms (%.1f ns/token)\n", tokens, flags, ms, ms * 1e6 / tokens);
+}
+
+/*
+ * flagfile of a few million tokens, serial against parallel parse.
+ */
+static void benchFlagfile() {
+    const size_t flags = 1000;
+    const size_t tokens = 4000000;
+    const char *path = "flag_bench_flagfile.txt";
+
+    std::FILE *file = std::fopen(path, "wb");
+    for (size_t i = 0; i < tokens; i++) {
+        if (i % 4 == 3)
+            std::fprintf(file, "/data/input/file_%zu.bin\n", i);
+        else
+            std::fprintf(file, "--plugin.flag_%zu=%zu\n", i * 7919 % flags, i);
+    }
+    std::fclose(file);
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::vector<int> values(flags);
+    for (size_t i = 0; i < flags; i++)
+        flag.registerInt("plugin.flag_" + std::to_string(i), &values[i]);
+
+    std::printf("flagfile %zu tokens\n", tokens);
+    double serial = 0;
+    for (unsigned threads : threadCounts()) {
+        double ms = elapsedMs([&]() { flag.parseFlagfile(path, threads); });
+        if (threads == 1)
+            serial = ms;
+        std::printf("  threads %2u: %8.2f ms, speedup %.2fx\n", threads, ms, serial / ms);
+    }
+    std::remove(path);
+}
+
+#ifndef _WIN32
+/*
+ * getopt style command line, Flag::parse against getopt_long_only.
+ */
+static void benchGetopt() {
+    const size_t rounds = 200000;
+
+    std::vector<std::string> storage;
+    for (size_t i = 0; i < rounds; i++) {
+        storage.push_back("-xvf");
+        storage.push_back("archive_" + std::to_string(i) + ".tar");
+        storage.push_back("--count=" + std::to_string(i));
+        storage.push_back("-ofile_" + std::to_string(i));
+    }
+    // positionals last, GNU getopt permutes interleaved ones in quadratic time.
+    for (size_t i = 0; i < rounds; i++)
+        storage.push_back("input_" + std::to_string(i) + ".txt");
+    std::vector<char *> argv;
+    argv.push_back((char *)"bench");
+    for (auto &token : storage)
+        argv.push_back(&token[0]);
+    argv.push_back(nullptr);
+    const int argc = static_cast<int>(argv.size() - 1);
+
+    bool extract = false, verbose = false;
+    std::string file, output;
+    int count = 0;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerBool("extract", &extract);
+    flag.registerBool("verbose", &verbose);
+    flag.registerString("file", &file);
+    flag.registerString("output", &output);
+    flag.registerInt("count", &count);
+    flag.alias('x', "extract");
+    flag.alias('v', "verbose");
+    flag.alias('f', "file");
+    flag.alias('o', "output");
+    flag.alias('n', "count");
+
+    std::vector<char *> copy = argv;
+    double ours = elapsedMs([&]() { flag.parse(argc, copy.data()); });
+
+    static const struct option options[] = {
+        { "extract", no_argument, nullptr, 'x' },
+        { "verbose", no_argument, nullptr, 'v' },
+        { "file", required_argument, nullptr, 'f' },
+        { "output", required_argument, nullptr, 'o' },
+        { "count", required_argument, nullptr, 'n' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    copy = argv;
+    optind = 0;
+    double theirs = elapsedMs([&]() {
+        for (int c; (c = getopt_long_only(argc, copy.data(), "xvf:o:n:", options, nullptr)) != -1;) {
+            switch (c) {
+                case 'x': extract = true; break;
+                case 'v': verbose = true; break;
+                case 'f': file = optarg; break;
+                case 'o': output = optarg; break;
+                case 'n': count = std::atoi(optarg); break;
+            }
+        }
+    });
+
+    std::printf("getopt style, %d tokens: Flag::parse %8.2f ms, getopt_long_only %8.2f ms\n", argc - 1, ours, theirs);
+}
+#endif
+
+int main() {
+    benchRegister();
+    benchLookup();
+    benchFlagfile();
+#ifndef _WIN32
+    benchGetopt();
+#endif
+    return 0;
+}
@@ -30,8 +30,34 @@
  */
 
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <thread>
 #include "cxx_opt.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CXX_OPT_SSE2
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define CXX_OPT_READ(fd, buf, size) _read(fd, buf, static_cast<unsigned>(size))
+#define CXX_OPT_WRITE(fd, buf, size) _write(fd, buf, static_cast<unsigned>(size))
+#else
+#include <unistd.h>
+#define CXX_OPT_READ(fd, buf, size) read(fd, buf, size)
+#define CXX_OPT_WRITE(fd, buf, size) write(fd, buf, size)
+#endif
+
 #define FLAG_NOT_CONTAINS_EQUAL_ASSERT(flag, error) \
     do { \
     if (flag.find('=') != std::string::npos) { \
@@ -55,206 +81,1124 @@
     FLAG_NOT_CONTAINS_EQUAL_ASSERT(name, "for" + name); \
     } while (0)
 
-static std::string toLower(const std::string &str) {
-    std::string result = str;
-    std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
-    return result;
+static inline unsigned char foldAscii(unsigned char c) {
+    return static_cast<unsigned char>(c - 'A') < 26 ? c | 0x20 : c;
 }
 
-CXX_OPT_NAMESPACE::Flag::Flag()
-    : cmd_(""), banner_("") {
-    registerHandler("help", [this](void *) { showHelp(); }, nullptr, "show help");
+#ifdef CXX_OPT_SSE2
+// 'A'..'Z' to 'a'..'z' for 16 bytes, other bytes unchanged
+static inline __m128i foldAscii16(__m128i x) {
+    // shift 'A'..'Z' to the bottom of the signed range, -128..-103
+    const __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(0x80 - 'A')));
+    const __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + 26)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
 }
+#endif
 
-CXX_OPT_NAMESPACE::Flag::~Flag() {
+// ASCII case insensitive compare of n bytes, in place
+static bool asciiCaseEqual(const char *lhs, const char *rhs, size_t n) noexcept {
+    size_t i = 0;
+#ifdef CXX_OPT_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i l = foldAscii16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lhs + i)));
+        __m128i r = foldAscii16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(rhs + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xFFFF)
+            return false;
+    }
+#endif
+    for (; i < n; i++) {
+        if (foldAscii(lhs[i]) != foldAscii(rhs[i]))
+            return false;
+    }
+    return true;
 }
 
-void CXX_OPT_NAMESPACE::Flag::parse(int argc, char **argv) {
-    char *cmd = argv[0];
-    char **arg_list = &argv[1];
-    int arg_count = argc - 1;
+// ASCII lower case of n bytes, in place
+static void asciiToLower(char *str, size_t n) noexcept {
+    size_t i = 0;
+#ifdef CXX_OPT_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i *p = reinterpret_cast<__m128i *>(str + i);
+        _mm_storeu_si128(p, foldAscii16(_mm_loadu_si128(p)));
+    }
+#endif
+    for (; i < n; i++)
+        str[i] = static_cast<char>(foldAscii(str[i]));
+}
 
-    for (int i = 0; i < arg_count; i++) {
-        std::string arg = arg_list[i];
-        
-        auto match = std::find_if(flags_.begin(), flags_.end(), [&](const std::pair<const FlagInfo, void*>& entry) {
-                const std::string &src = entry.first.name_;
-                const std::string &dst = arg;
-
-                if (dst[0] == '-' && dst[1] != '-')
-                    return dst.compare(1, src.length(), src) == 0 &&
-                           (dst.length() == src.length() + 1 || dst[src.length() + 1] == '=');
-                else if (dst[0] == '-' && dst[1] == '-')
-                    return dst.compare(2, src.length(), src) == 0 &&
-                           (dst.length() == src.length() + 2 || dst[src.length() + 2] == '=');
-
-                // if (dst[0] == '-' && dst[1] != '-')
-                //     return dst.compare(1, src.length(), src) == 0;
-                // else if (dst[0] == '-' && dst[1] == '-')
-                //     return dst.compare(2, src.length(), src) == 0;
-
-                return false;
-            });
-
-        // unkown flag insert to args_.
-        if (match == flags_.end()) {
-            args_.push_back(std::move(arg));
-            continue;
-        }
+static bool hasFold(CXX_OPT_NAMESPACE::CaseFold policy, CXX_OPT_NAMESPACE::CaseFold fold) noexcept {
+    return (static_cast<int>(policy) & static_cast<int>(fold)) != 0;
+}
 
-        std::string argument;
-        if (arg.find("==") != std::string::npos) {
-            argument = arg.substr(arg.find("==") + 2);      
-        } else if (arg.find('=') != std::string::npos) {
-            argument = arg.substr(arg.find('=') + 1);
-        } else {
-            if (match->first.type_ == FlagType::Handler) {
-                
-            }else if (match->first.type_ == FlagType::Bool) {
-                argument = "true";
-            } else if ((i + 1) >= arg_count) {
-                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(arg + " argument not found");
-            } else {
-                argument = arg_list[i + 1];
-                i++;
-            }
-        }
+// value equals literal, folded per policy
+static bool valueEqual(const char *value, size_t length, const char *literal, bool fold) noexcept {
+    size_t n = std::strlen(literal);
+    return length == n && (fold ? asciiCaseEqual(value, literal, n) : std::memcmp(value, literal, n) == 0);
+}
 
-        argument = toLower(argument);
+// JSON string body of str, escaped
+static void appendJsonString(std::string &out, const std::string &str) {
+    static const char hex[] = "0123456789abcdef";
 
-        try {
-            switch (match->first.type_) {
-                case FlagType::String: {
-                    *static_cast<std::string*>(match->second) = argument;
-                } break;
-                case FlagType::Int: {
-                    *static_cast<int*>(match->second) = std::stoi(argument); 
-                } break;
-                case FlagType::Bool: {
-                    bool *save_ptr = static_cast<bool*>(match->second);
-                    if (argument == "true" || argument == "1") {
-                        *save_ptr = true;
-                    } else if (argument == "false" || argument == "0") {
-                        *save_ptr = false;
-                    } else {
-                        throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(arg + " Bool argument is invalid");
-                    }
-                } break;
-                case FlagType::Float: {
-                    *static_cast<float*>(match->second) = std::stof(argument);
-                } break;
-                case FlagType::Handler: {
-                    match->first.handler_(match->first.context);
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xF];
+                } else {
+                    out += static_cast<char>(c);
                 }
-            }
+        }
+    }
+}
 
-        } catch (const FlagException &e) {
-            throw e;
-        } catch (const std::exception &e) {
-            throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(arg + " " + e.what());
+// run fn(0) .. fn(parts - 1) on parts threads, the caller being one of them
+template <typename Fn>
+static void forEachPart(size_t parts, const Fn &fn) {
+    std::vector<std::exception_ptr> errors(parts);
+    auto run = [&](size_t part) {
+        try {
+            fn(part);
+        } catch (...) {
+            errors[part] = std::current_exception();
         }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(parts - 1);
+    try {
+        for (size_t part = 1; part < parts; part++)
+            workers.emplace_back(run, part);
+    } catch (...) {
+        for (auto &worker : workers)
+            worker.join();
+        throw;
+    }
+    run(0);
+    for (auto &worker : workers)
+        worker.join();
+
+    for (auto &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
     }
 }
 
-void CXX_OPT_NAMESPACE::Flag::banner(const std::string &banner) {
-    banner_ = banner;
+// FNV-1a over ASCII folded bytes, names differing in case only collide
+static const uint64_t kHashSeed = 14695981039346656037ULL;
+
+static inline uint64_t hashStep(uint64_t hash, char c) noexcept {
+    return (hash ^ foldAscii(c)) * 1099511628211ULL;
 }
 
-void CXX_OPT_NAMESPACE::Flag::printDefaults() const noexcept {
-    for (const auto &flag : flags_) {
-        const FlagInfo &info = flag.first;
-        std::fprintf(stderr, "  -%s %s\n", info.name_.c_str(), flagTypeToString(info.type_));
+static inline size_t hashFinish(uint64_t hash) noexcept {
+    return static_cast<size_t>(hash ^ (hash >> 32));
+}
 
-        // help (default "default")
-        switch (info.type_) {
-        case FlagType::String: {
-            std::fprintf(stderr, "    %s (default: %s)\n", info.help_.c_str(), info.default_.string_);
-        } break;
-        case FlagType::Int: {
-            std::fprintf(stderr, "    %s (default: %d)\n", info.help_.c_str(), info.default_.int_);
-        } break;
-        case FlagType::Bool: {
-            std::fprintf(stderr, "    %s (default: %s)\n", info.help_.c_str(), info.default_.bool_ ? "true" : "false");
-        } break;
-        case FlagType::Float: {
-            std::fprintf(stderr, "    %s (default: %0.2f)\n", info.help_.c_str(), info.default_.float_);
-        } break;
-        case FlagType::Handler: {
-            std::fprintf(stderr, "    %s\n", info.help_.c_str());
-        } break;
-        }
-    }
+static size_t hashName(const char *name, size_t size) noexcept {
+    uint64_t hash = kHashSeed;
+    for (size_t i = 0; i < size; i++)
+        hash = hashStep(hash, name[i]);
+    return hashFinish(hash);
+}
+
+
+const char *CXX_OPT_NAMESPACE::Args::at(size_t index) const {
+    if (index >= size())
+        throw std::out_of_range("args index out of range");
+    return (*this)[index];
 }
 
-void CXX_OPT_NAMESPACE::Flag::registerString(const std::string &name, std::string *value, const std::string &help) {
+void CXX_OPT_NAMESPACE::Args::clear() noexcept {
+    scattered_.clear();
+    tail_ = nullptr;
+    tail_size_ = 0;
+}
+
+CXX_OPT_NAMESPACE::FlagSet::FlagSet() : generation_(0) {
+    std::fill(shorts_, shorts_ + 128, nullptr);
+}
+
+CXX_OPT_NAMESPACE::FlagSet::~FlagSet() {
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::registerString(const std::string &name, std::string *value, const std::string &help, CaseFold fold) {
     REGISTER_PARAM_CHECK_ASSERT(name, value);
 
     FlagInfo info;
     info.type_ = FlagType::String;
     info.name_ = name;
     info.help_ = help;
-    info.default_.string_ = value->c_str();
+    info.fold_ = fold;
+    info.default_string_ = *value;
 
-    flags_[info] = value;
+    info.value_ = value;
+
+    insert(info);
 }
 
-void CXX_OPT_NAMESPACE::Flag::registerInt(const std::string &name, int *value, const std::string &help) {
+void CXX_OPT_NAMESPACE::FlagSet::registerInt(const std::string &name, int *value, const std::string &help, CaseFold fold) {
     REGISTER_PARAM_CHECK_ASSERT(name, value);
 
     FlagInfo info;
     info.type_ = FlagType::Int;
     info.name_ = name;
     info.help_ = help;
+    info.fold_ = fold;
     info.default_.int_ = *value;
 
-    flags_[info] = value;
+    info.value_ = value;
+
+    insert(info);
 }
 
-void CXX_OPT_NAMESPACE::Flag::registerBool(const std::string &name, bool *value, const std::string &help) {
+void CXX_OPT_NAMESPACE::FlagSet::registerBool(const std::string &name, bool *value, const std::string &help, CaseFold fold) {
     REGISTER_PARAM_CHECK_ASSERT(name, value);
 
     FlagInfo info;
     info.type_ = FlagType::Bool;
     info.name_ = name;
     info.help_ = help;
+    info.fold_ = fold;
     info.default_.bool_ = *value;
 
-    flags_[info] = value;
+    info.value_ = value;
+
+    insert(info);
 }
 
-void CXX_OPT_NAMESPACE::Flag::registerFloat(const std::string &name, float *value, const std::string &help) {
+void CXX_OPT_NAMESPACE::FlagSet::registerFloat(const std::string &name, float *value, const std::string &help, CaseFold fold) {
     REGISTER_PARAM_CHECK_ASSERT(name, value);
 
     FlagInfo info;
     info.type_ = FlagType::Float;
     info.name_ = name;
     info.help_ = help;
+    info.fold_ = fold;
     info.default_.float_ = *value;
 
-    flags_[info] = value;
+    info.value_ = value;
+
+    insert(info);
 }
 
-void CXX_OPT_NAMESPACE::Flag::registerHandler(const std::string &name,
-                                              std::function<void (void *)> handler,
+void CXX_OPT_NAMESPACE::FlagSet::registerHandler(const std::string &name,
+                                              FlagHandler handler,
                                               void *context,
-                                              const std::string &help) {
+                                              const std::string &help,
+                                              CaseFold fold,
+                                              int priority) {
     REGISTER_PARAM_CHECK_ASSERT(name, handler);
 
     FlagInfo info;
     info.type_ = FlagType::Handler;
     info.name_ = name;
     info.help_ = help;
+    info.fold_ = fold;
     info.handler_ = handler;
     info.context = context;
+    info.priority_ = priority;
+
+    info.value_ = nullptr;
+
+    insert(info);
+}
+
+bool CXX_OPT_NAMESPACE::FlagSet::NameKeyEqual::operator()(const NameKey &lhs, const NameKey &rhs) const noexcept {
+    if (lhs.size_ != rhs.size_)
+        return false;
+    return lhs.fold_ || rhs.fold_ ? asciiCaseEqual(lhs.data_, rhs.data_, lhs.size_)
+                                  : std::memcmp(lhs.data_, rhs.data_, lhs.size_) == 0;
+}
+
+CXX_OPT_NAMESPACE::FlagSet::NameKey CXX_OPT_NAMESPACE::FlagSet::makeKey(const char *name, size_t size, size_t hash, bool fold) noexcept {
+    NameKey key;
+    key.data_ = name;
+    key.size_ = size;
+    key.hash_ = hash;
+    key.fold_ = fold;
+    return key;
+}
+
+CXX_OPT_NAMESPACE::FlagSet::NameKey CXX_OPT_NAMESPACE::FlagSet::makeKey(const char *name, size_t size, bool fold) noexcept {
+    return makeKey(name, size, hashName(name, size), fold);
+}
+
+CXX_OPT_NAMESPACE::FlagSet::NameKey CXX_OPT_NAMESPACE::FlagSet::makeKey(const FlagInfo &info) noexcept {
+    return makeKey(info.name_.data(), info.name_.length(), hasFold(info.fold_, CaseFold::Name));
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::insert(const FlagInfo &info) {
+    std::unique_ptr<FlagInfo> flag(new FlagInfo(info));
+    Shard &shard = shardOf(makeKey(*flag));
+
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    insertLocked(shard, std::move(flag));
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::insertLocked(Shard &shard, std::unique_ptr<FlagInfo> flag) {
+    NameKey key = makeKey(*flag);
+    FlagInfo *info = flag.get();
+
+    // re-registering replaces the flag and keeps its alias, the stored key
+    // points into the old one.
+    FlagMap::iterator old = shard.flags_.find(key);
+    if (old != shard.flags_.end()) {
+        // a folded name matches other spellings, never replace one of them
+        if (old->second->name_ != info->name_)
+            throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError("for " + info->name_ + ", differs from " + old->second->name_ + " by case only");
+        moveShort(old->second.get(), info);
+        shard.flags_.erase(old);
+    }
+    shard.flags_.emplace(key, std::move(flag));
+    generation_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::moveShort(const FlagInfo *from, FlagInfo *to) {
+    std::lock_guard<std::mutex> lock(shorts_mutex_);
+    moveShortLocked(from, to);
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::moveShortLocked(const FlagInfo *from, FlagInfo *to) noexcept {
+    if (from->short_ == '\0')
+        return;
+
+    FlagInfo *&alias = shorts_[static_cast<unsigned char>(from->short_)];
+    if (alias == from) {
+        alias = to;
+        if (to != nullptr)
+            to->short_ = from->short_;
+    }
+}
+
+bool CXX_OPT_NAMESPACE::FlagSet::unregisterFlag(const std::string &name) {
+    NameKey key = makeKey(name.data(), name.length(), false);
+    Shard &shard = shardOf(key);
+
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    FlagMap::iterator match = shard.flags_.find(key);
+    if (match == shard.flags_.end())
+        return false;
+
+    moveShort(match->second.get(), nullptr);
+    shard.flags_.erase(match);
+    generation_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::alias(char shortName, const std::string &name) {
+    const unsigned char c = static_cast<unsigned char>(shortName);
+    if (c >= 128 || !std::isalnum(c))
+        throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string("for alias -") + shortName);
+
+    NameKey key = makeKey(name.data(), name.length(), false);
+    Shard &shard = shardOf(key);
+
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    FlagMap::iterator match = shard.flags_.find(key);
+    if (match == shard.flags_.end())
+        throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError("for alias of unregistered " + name);
+
+    FlagInfo *info = match->second.get();
+
+    std::lock_guard<std::mutex> shorts_lock(shorts_mutex_);
+    moveShortLocked(info, nullptr);
+    if (shorts_[c] != nullptr && shorts_[c] != info)
+        shorts_[c]->short_ = '\0';
+    shorts_[c] = info;
+    info->short_ = shortName;
+    generation_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::merge(const FlagSet &set, const std::string &prefix) {
+    if (&set == this)
+        throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError("merge a flag set into itself");
+    FLAG_NOT_CONTAINS_EQUAL_ASSERT(prefix, "for merge prefix " + prefix);
+
+    std::vector<std::unique_ptr<FlagInfo>> incoming;
+    incoming.reserve(set.size());
+    for (const Shard &shard : set.shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        std::lock_guard<std::mutex> shorts_lock(set.shorts_mutex_);   // copies short_
+        for (const auto &flag : shard.flags_) {
+            std::unique_ptr<FlagInfo> info(new FlagInfo(*flag.second));
+            info->short_ = '\0';
+            if (!prefix.empty())
+                info->name_ = prefix + "." + info->name_;
+            incoming.push_back(std::move(info));
+        }
+    }
+
+    // all shards, in order, so that check and insert see the same registry.
+    std::unique_lock<std::mutex> locks[kShardCount];
+    for (size_t i = 0; i < kShardCount; i++)
+        locks[i] = std::unique_lock<std::mutex>(shards_[i].mutex_);
+
+    std::string conflicts;
+    for (const auto &info : incoming) {
+        NameKey key = makeKey(*info);
+        const FlagMap &flags = shardOf(key).flags_;
+        if (flags.find(key) != flags.end())
+            conflicts += (conflicts.empty() ? "" : ", ") + info->name_;
+    }
+    if (!conflicts.empty())
+        throw CXX_OPT_NAMESPACE::FlagConflictError(conflicts);
+
+    for (auto &info : incoming) {
+        Shard &shard = shardOf(makeKey(*info));
+        insertLocked(shard, std::move(info));
+    }
+}
+
+size_t CXX_OPT_NAMESPACE::FlagSet::size() const {
+    size_t count = 0;
+    for (const Shard &shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        count += shard.flags_.size();
+    }
+    return count;
+}
+
+std::vector<const CXX_OPT_NAMESPACE::FlagSet::FlagInfo *> CXX_OPT_NAMESPACE::FlagSet::sortedFlags() const {
+    std::vector<const FlagInfo *> flags;
+    for (const Shard &shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        for (const auto &flag : shard.flags_)
+            flags.push_back(flag.second.get());
+    }
+    std::sort(flags.begin(), flags.end(), [](const FlagInfo *lhs, const FlagInfo *rhs) { return *lhs < *rhs; });
+    return flags;
+}
+
+char CXX_OPT_NAMESPACE::FlagSet::shortOf(const FlagInfo &info) const {
+    std::lock_guard<std::mutex> lock(shorts_mutex_);
+    return info.short_;
+}
+
+void CXX_OPT_NAMESPACE::FlagSet::scan(const char *token, Scan *out) noexcept {
+    out->dashes_ = token[0] != '-' ? 0 : token[1] != '-' ? 1 : 2;
+    out->name_ = token + out->dashes_;
+    out->value_ = nullptr;
+
+    // positionals are not scanned at all
+    if (out->dashes_ == 0) {
+        out->size_ = 0;
+        out->hash_ = 0;
+        return;
+    }
+
+    uint64_t hash = kHashSeed;
+    const char *p = out->name_;
+    for (; *p != '\0' && *p != '='; p++)
+        hash = hashStep(hash, *p);
+
+    out->size_ = p - out->name_;
+    out->hash_ = hashFinish(hash);
+    if (*p == '=')
+        out->value_ = p[1] == '=' ? p + 2 : p + 1;
+}
+
+CXX_OPT_NAMESPACE::FlagSet::FlagInfo *CXX_OPT_NAMESPACE::FlagSet::lookup(const Scan &scan) {
+    if (scan.size_ == 0)
+        return nullptr;
+
+    NameKey key = makeKey(scan.name_, scan.size_, scan.hash_, false);
+    Shard &shard = shardOf(key);
+    FlagMap::iterator match = shard.flags_.find(key);
+    return match == shard.flags_.end() ? nullptr : match->second.get();
+}
+
+CXX_OPT_NAMESPACE::Flag::Flag()
+    : cmd_(""), banner_(""), depth_(0), handler_order_(HandlerOrder::Inline), stop_at_double_dash_(false), stop_at_first_arg_(false) {
+    registerHandler("help", [this](void *) { showHelp(); }, nullptr, "show help");
+}
+
+CXX_OPT_NAMESPACE::Flag::~Flag() {
+}
+
+/*
+ * Single pass state machine behind every parse entry. A token is scanned
+ * once (dashes, name hash and '=' together), its name resolved with one
+ * hash lookup, short option clusters are walked in place.
+ */
+struct CXX_OPT_NAMESPACE::Flag::Tokenizer {
+    enum Result {
+        Consumed,     // flag, flag value or cluster
+        Positional,   // first positional ends parsing when terminated_ is set
+        Terminator    // "--" with stopAtDoubleDash
+    };
+
+    Flag &flag_;
+    FlagInfo *pending_;           // flag waiting for its value token
+    const char *pending_token_;
+    bool terminated_;
+
+    explicit Tokenizer(Flag &flag) : flag_(flag), pending_(nullptr), pending_token_(nullptr), terminated_(false) {}
+
+    // emit(FlagInfo &, token, value) for every flag occurrence, in order
+    template <typename Emit>
+    Result feed(const char *token, const Emit &emit) {
+        Scan scan = Scan();
+        FlagInfo *match = nullptr;
+        if (pending_ == nullptr && !terminated_) {
+            FlagSet::scan(token, &scan);
+            match = flag_.lookup(scan);
+        }
+        return feed(token, scan, match, emit);
+    }
+
+    // token scanned and looked up beforehand, match unused for values
+    template <typename Emit>
+    Result feed(const char *token, const Scan &scan, FlagInfo *match, const Emit &emit) {
+        if (pending_ != nullptr) {
+            FlagInfo *info = pending_;
+            pending_ = nullptr;
+            emit(*info, pending_token_, token);
+            return Consumed;
+        }
+
+        if (terminated_)
+            return Positional;
+
+        if (scan.dashes_ == 2 && scan.size_ == 0 && scan.value_ == nullptr && flag_.stop_at_double_dash_) {
+            terminated_ = true;
+            return Terminator;
+        }
+
+        if (match != nullptr) {
+            if (scan.value_ == nullptr && needsValue(*match)) {
+                pending_ = match;
+                pending_token_ = token;
+            } else {
+                emit(*match, token, scan.value_);
+            }
+            return Consumed;
+        }
+
+        if (scan.dashes_ == 1 && flag_.lookupShort(token[1]) != nullptr)
+            return cluster(token, emit);
+
+        terminated_ = flag_.stop_at_first_arg_;
+        return Positional;
+    }
+
+    // -xvf file, -ofile: bools until a flag taking the rest or the next token
+    template <typename Emit>
+    Result cluster(const char *token, const Emit &emit) {
+        for (const char *p = token + 1; *p != '\0'; p++) {
+            FlagInfo *info = flag_.lookupShort(*p);
+            if (info == nullptr)
+                throw CXX_OPT_NAMESPACE::ParseError(std::string("unknown short flag -") + *p + " in " + token);
+
+            if (needsValue(*info)) {
+                if (p[1] != '\0') {
+                    emit(*info, token, p + 1);
+                } else {
+                    pending_ = info;
+                    pending_token_ = token;
+                }
+                return Consumed;
+            }
+            emit(*info, token, nullptr);
+        }
+        return Consumed;
+    }
+
+    // pending_token_ into storage, before the buffer holding it is reused
+    void keepPending(std::string &storage) {
+        if (pending_ != nullptr) {
+            storage = pending_token_;
+            pending_token_ = storage.c_str();
+        }
+    }
+
+    // end of input
+    void finish() const {
+        if (pending_ != nullptr)
+            throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(pending_token_) + " argument not found");
+    }
+};
+
+/*
+ * Scope of a parse entry. A handler may parse again while a parse runs,
+ * e.g. to include a flagfile: the outermost parse resets args(), the
+ * flagfiles and the deferred handlers, nested ones add to them, and the
+ * outermost runs the deferred handlers once everything parsed.
+ */
+struct CXX_OPT_NAMESPACE::Flag::Nesting {
+    explicit Nesting(Flag &flag) : flag_(flag), outermost_(flag.depth_++ == 0) {
+        if (outermost_) {
+            flag_.args_.clear();
+            flag_.flagfiles_.clear();
+            flag_.deferred_.clear();
+        }
+    }
+    ~Nesting() { flag_.depth_--; }
+
+    // on success only, a failed parse runs no deferred handler
+    void finish() {
+        if (outermost_)
+            flag_.runDeferred();
+    }
+
+    Flag &flag_;
+    bool outermost_;
+};
+
+void CXX_OPT_NAMESPACE::Flag::parse(int argc, char **argv) {
+    char **arg_list = &argv[1];
+    int arg_count = argc - 1;
+
+    Tokenizer tokenizer(*this);
+    auto emit = [this](FlagInfo &info, const char *token, const char *value) {
+        apply(info, token, value);
+    };
+
+    Nesting nesting(*this);
+
+    for (int i = 0; i < arg_count; i++) {
+        const char *token = arg_list[i];
+
+        switch (tokenizer.feed(token, emit)) {
+            case Tokenizer::Consumed:
+                continue;
+            case Tokenizer::Terminator:
+                args_.tail_ = &arg_list[i + 1];
+                args_.tail_size_ = arg_count - i - 1;
+                nesting.finish();
+                return;
+            case Tokenizer::Positional:
+                break;
+        }
+
+        // the rest of argv is kept as a span, never scanned.
+        if (tokenizer.terminated_) {
+            args_.tail_ = &arg_list[i];
+            args_.tail_size_ = arg_count - i;
+            nesting.finish();
+            return;
+        }
+        // unkown flag is positional, the view keeps the argv pointer only.
+        args_.scattered_.push_back(token);
+    }
+
+    tokenizer.finish();
+    nesting.finish();
+}
+
+void CXX_OPT_NAMESPACE::Flag::parseStream(int fd,
+                                          const std::function<void (const Args &)> &handler,
+                                          char delimiter,
+                                          size_t chunkSize,
+                                          size_t batchSize) {
+    if (chunkSize == 0 || batchSize == 0)
+        throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError("stream chunk size or batch size == 0");
+
+    // one byte over chunkSize for the delimiter or terminator of a full token
+    const size_t capacity = chunkSize + 1;
+    std::unique_ptr<char[]> buffer(new char[capacity]);
+    Args batch;
+    batch.scattered_.reserve(batchSize);
+
+    Tokenizer tokenizer(*this);
+    std::string pending_token;                  // flag token outliving its chunk
+    size_t carry = 0;                           // bytes of a token cut by the chunk end
+
+    Nesting nesting(*this);
+
+    auto flush = [&]() {
+        if (!batch.scattered_.empty()) {
+            handler(batch);
+            batch.scattered_.clear();
+        }
+    };
+
+    auto emit = [this](FlagInfo &info, const char *token, const char *value) {
+        apply(info, token, value);
+    };
+
+    auto consume = [&](const char *token) {
+        if (tokenizer.feed(token, emit) != Tokenizer::Positional)
+            return;
+
+        batch.scattered_.push_back(token);
+        if (batch.scattered_.size() == batchSize)
+            flush();
+    };
+
+    for (;;) {
+        ptrdiff_t n = CXX_OPT_READ(fd, buffer.get() + carry, capacity - carry);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw CXX_OPT_NAMESPACE::ParseError(std::string("read stream: ") + std::strerror(errno));
+        }
+
+        char *begin = buffer.get();
+        char *end = begin + carry + n;
+
+        if (n == 0) {
+            // last token without a trailing delimiter, there is always room
+            // for its terminator: a carry over chunkSize fails below.
+            if (begin != end) {
+                *end = '\0';
+                consume(begin);
+            }
+            flush();
+            break;
+        }
+
+        for (char *delim; (delim = static_cast<char *>(std::memchr(begin, delimiter, end - begin))) != nullptr; begin = delim + 1) {
+            *delim = '\0';
+            if (begin != delim)
+                consume(begin);
+        }
+
+        // batch points into the buffer, hand it out before the buffer is reused.
+        flush();
+        tokenizer.keepPending(pending_token);
+
+        carry = end - begin;
+        if (carry > chunkSize)
+            throw CXX_OPT_NAMESPACE::ParseError("stream token longer than chunk size");
+        std::memmove(buffer.get(), begin, carry);
+    }
+
+    tokenizer.finish();
+    nesting.finish();
+}
+
+// token of a flagfile, looked up speculatively by the tokenizing worker
+struct CXX_OPT_NAMESPACE::Flag::Token {
+    const char *text_;
+    Scan scan_;
+    FlagInfo *flag_;
+};
+
+// flag assignment in file order
+struct CXX_OPT_NAMESPACE::Flag::Step {
+    FlagInfo *flag_;
+    const char *token_;
+    const char *value_;
+    Value converted_;
+};
+
+void CXX_OPT_NAMESPACE::Flag::parseFlagfile(const std::string &path, unsigned threads) {
+    Nesting nesting(*this);
+
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        throw CXX_OPT_NAMESPACE::ParseError("open flagfile " + path + ": " + std::strerror(errno));
+
+    std::vector<char> data;
+    char chunk[64 * 1024];
+    for (size_t n; (n = std::fread(chunk, 1, sizeof chunk, file)) != 0;)
+        data.insert(data.end(), chunk, chunk + n);
+    bool failed = std::ferror(file) != 0;
+    std::fclose(file);
+    if (failed)
+        throw CXX_OPT_NAMESPACE::ParseError("read flagfile " + path);
+
+    // the last line may lack its line break, every token ends on one.
+    data.push_back('\n');
+
+    // an outer flagfile still being parsed keeps its buffer, see Nesting.
+    flagfiles_.push_back(std::vector<char>());
+    flagfiles_.back().swap(data);
+
+    parseBuffer(flagfiles_.back().data(), flagfiles_.back().size(), threads);
+    nesting.finish();
+}
+
+void CXX_OPT_NAMESPACE::Flag::parseBuffer(char *data, size_t size, unsigned threads) {
+    // below this a part is not worth a thread
+    const size_t kMinPartSize = 64 * 1024;
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t parts = std::max<size_t>(1, std::min<size_t>(threads, size / kMinPartSize));
+
+    // part boundaries just after a line break, size ends with one.
+    std::vector<char *> bounds(parts + 1, data + size);
+    bounds[0] = data;
+    for (size_t part = 1; part < parts; part++) {
+        char *begin = std::max(bounds[part - 1], data + size * part / parts);
+        bounds[part] = begin == data + size ? begin : static_cast<char *>(std::memchr(begin, '\n', data + size - begin)) + 1;
+    }
+
+    // tokenize and look up names in parallel, lookups take no lock.
+    std::vector<std::vector<Token>> tokens(parts);
+    forEachPart(parts, [&](size_t part) {
+        for (char *begin = bounds[part], *delim; begin != bounds[part + 1]; begin = delim + 1) {
+            delim = static_cast<char *>(std::memchr(begin, '\n', bounds[part + 1] - begin));
+            *delim = '\0';
+            if (begin != delim) {
+                Token token;
+                token.text_ = begin;
+                scan(begin, &token.scan_);
+                token.flag_ = lookup(token.scan_);
+                tokens[part].push_back(token);
+            }
+        }
+    });
+
+    // pair flags with values in file order, the rules of parse(). An inline
+    // handler may change the registry the looked up steps point into: the
+    // steps before its token are applied, its token is applied as parse()
+    // does, and after a registry change the rest of the file is too.
+    std::vector<Step> steps;
+    bool barrier = false;
+    bool serial = false;
+    Tokenizer tokenizer(*this);
+    auto emit = [&](FlagInfo &info, const char *token, const char *value) {
+        barrier |= info.type_ == FlagType::Handler && handler_order_ == HandlerOrder::Inline;
+        Step step = { &info, token, value, Value() };
+        steps.push_back(step);
+    };
+    auto emit_now = [this](FlagInfo &info, const char *token, const char *value) {
+        apply(info, token, value);
+    };
+
+    for (const auto &part : tokens) {
+        for (const Token &token : part) {
+            Tokenizer::Result result;
+            if (serial) {
+                result = tokenizer.feed(token.text_, emit_now);
+            } else {
+                // an error here surfaces after the steps before it, as in parse().
+                const size_t mark = steps.size();
+                try {
+                    result = tokenizer.feed(token.text_, token.scan_, token.flag_, emit);
+                } catch (const FlagException &) {
+                    std::exception_ptr resolve_error = std::current_exception();
+                    applySteps(steps, parts);
+                    std::rethrow_exception(resolve_error);
+                }
+
+                if (barrier) {
+                    // a handler takes no value, nothing was pending before its token
+                    barrier = false;
+                    steps.resize(mark);
+                    tokenizer.pending_ = nullptr;
+                    applySteps(steps, parts);
+                    steps.clear();
+
+                    const size_t generation = this->generation();
+                    result = tokenizer.feed(token.text_, emit_now);
+                    serial = this->generation() != generation;
+                }
+            }
+            if (result == Tokenizer::Positional)
+                args_.scattered_.push_back(token.text_);
+        }
+    }
+
+    applySteps(steps, parts);
+    tokenizer.finish();
+}
+
+void CXX_OPT_NAMESPACE::Flag::applySteps(std::vector<Step> &steps, size_t parts) {
+    // convert values in parallel, keep the first error of every part.
+    parts = std::max<size_t>(1, std::min<size_t>(parts, steps.size()));
+    std::vector<size_t> failed(parts, steps.size());
+    std::vector<std::exception_ptr> errors(parts);
+    forEachPart(parts, [&](size_t part) {
+        for (size_t i = steps.size() * part / parts; i < steps.size() * (part + 1) / parts; i++) {
+            Step &step = steps[i];
+            try {
+                convert(*step.flag_, step.token_, step.value_, &step.converted_);
+            } catch (const FlagException &) {
+                failed[part] = i;
+                errors[part] = std::current_exception();
+                break;
+            }
+        }
+    });
+
+    // apply in order, failing at the same step as the serial parse would.
+    size_t first_failed = steps.size();
+    std::exception_ptr error;
+    for (size_t part = 0; part < parts; part++) {
+        if (failed[part] < first_failed) {
+            first_failed = failed[part];
+            error = errors[part];
+        }
+    }
+
+    for (size_t i = 0; i < first_failed; i++)
+        store(*steps[i].flag_, steps[i].value_, steps[i].converted_);
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+bool CXX_OPT_NAMESPACE::Flag::needsValue(const FlagInfo &info) noexcept {
+    return info.type_ != FlagType::Handler && info.type_ != FlagType::Bool;
+}
+
+void CXX_OPT_NAMESPACE::Flag::apply(FlagInfo &info, const char *token, const char *value) {
+    Value converted;
+    convert(info, token, value, &converted);
+    store(info, value, converted);
+}
+
+void CXX_OPT_NAMESPACE::Flag::convert(const FlagInfo &info, const char *token, const char *value, Value *converted) {
+    if (value == nullptr)
+        value = info.type_ == FlagType::Bool ? "true" : "";
+
+    switch (info.type_) {
+        case FlagType::Int: {
+            char *end;
+            errno = 0;
+            long number = std::strtol(value, &end, 10);
+            if (end == value)
+                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(token) + " Int argument is invalid");
+            if (errno == ERANGE || number < INT_MIN || number > INT_MAX)
+                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(token) + " Int argument out of range");
+            converted->int_ = static_cast<int>(number);
+        } break;
+        case FlagType::Bool: {
+            const bool fold = hasFold(info.fold_, CaseFold::Value);
+            const size_t length = std::strlen(value);
+            if (valueEqual(value, length, "true", fold) || valueEqual(value, length, "1", fold)) {
+                converted->bool_ = true;
+            } else if (valueEqual(value, length, "false", fold) || valueEqual(value, length, "0", fold)) {
+                converted->bool_ = false;
+            } else {
+                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(token) + " Bool argument is invalid");
+            }
+        } break;
+        case FlagType::Float: {
+            char *end;
+            errno = 0;
+            float number = std::strtof(value, &end);
+            if (end == value)
+                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(token) + " Float argument is invalid");
+            if (errno == ERANGE)
+                throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(std::string(token) + " Float argument out of range");
+            converted->float_ = number;
+        } break;
+        case FlagType::String:
+        case FlagType::Handler:
+            break;
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::store(FlagInfo &info, const char *value, const Value &converted) {
+    info.set_ = true;
+
+    switch (info.type_) {
+        case FlagType::String: {
+            std::string *save_ptr = static_cast<std::string*>(info.value_);
+            save_ptr->assign(value != nullptr ? value : "");
+            if (hasFold(info.fold_, CaseFold::Value))
+                asciiToLower(&(*save_ptr)[0], save_ptr->length());
+        } break;
+        case FlagType::Int: {
+            *static_cast<int*>(info.value_) = converted.int_;
+        } break;
+        case FlagType::Bool: {
+            *static_cast<bool*>(info.value_) = converted.bool_;
+        } break;
+        case FlagType::Float: {
+            *static_cast<float*>(info.value_) = converted.float_;
+        } break;
+        case FlagType::Handler: {
+            if (handler_order_ == HandlerOrder::Inline)
+                info.handler_(info.context);
+            else
+                deferred_.push_back(Deferred{ info.handler_, info.context, info.priority_ });
+        }
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::runDeferred() {
+    // a handler may parse a flagfile, which defers more handlers.
+    std::vector<Deferred> deferred;
+    while (!deferred_.empty()) {
+        if (handler_order_ == HandlerOrder::Priority) {
+            std::stable_sort(deferred_.begin(), deferred_.end(), [](const Deferred &lhs, const Deferred &rhs) {
+                    return lhs.priority_ > rhs.priority_;
+                });
+        }
+
+        deferred.swap(deferred_);
+        for (const Deferred &call : deferred)
+            call.handler_(call.context_);
+        deferred.clear();
+    }
+    deferred_.swap(deferred);
+}
+
+void CXX_OPT_NAMESPACE::Flag::banner(const std::string &banner) {
+    banner_ = banner;
+}
+
+void CXX_OPT_NAMESPACE::Flag::printDefaults() const noexcept {
+    for (const FlagInfo *flag : sortedFlags()) {
+        const FlagInfo &info = *flag;
+        const char short_name = shortOf(info);
+        if (short_name != '\0')
+            std::fprintf(stderr, "  -%c, -%s %s\n", short_name, info.name_.c_str(), flagTypeToString(info.type_));
+        else
+            std::fprintf(stderr, "  -%s %s\n", info.name_.c_str(), flagTypeToString(info.type_));
+
+        // help (default "default")
+        switch (info.type_) {
+        case FlagType::String: {
+            std::fprintf(stderr, "    %s (default: %s)\n", info.help_.c_str(), info.default_string_.c_str());
+        } break;
+        case FlagType::Int: {
+            std::fprintf(stderr, "    %s (default: %d)\n", info.help_.c_str(), info.default_.int_);
+        } break;
+        case FlagType::Bool: {
+            std::fprintf(stderr, "    %s (default: %s)\n", info.help_.c_str(), info.default_.bool_ ? "true" : "false");
+        } break;
+        case FlagType::Float: {
+            std::fprintf(stderr, "    %s (default: %0.2f)\n", info.help_.c_str(), info.default_.float_);
+        } break;
+        case FlagType::Handler: {
+            std::fprintf(stderr, "    %s\n", info.help_.c_str());
+        } break;
+        }
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::dumpJson(int fd) const {
+    dumpJson(dump_);
+    writeDump(fd);
+}
+
+void CXX_OPT_NAMESPACE::Flag::dumpFlagfile(int fd) const {
+    dumpFlagfile(dump_);
+    writeDump(fd);
+}
+
+void CXX_OPT_NAMESPACE::Flag::dumpJson(std::string &out) const {
+    out.clear();
+    out += '{';
+    for (const FlagInfo *flag : sortedFlags()) {
+        const FlagInfo &info = *flag;
+        if (info.type_ == FlagType::Handler)
+            continue;
+
+        if (out.size() > 1)
+            out += ',';
+        out += '"';
+        appendJsonString(out, info.name_);
+        out += "\":{\"type\":\"";
+        out += flagTypeToString(info.type_);
+        out += "\",\"value\":";
+        dumpValue(info, out, true, true);
+        out += ",\"default\":";
+        dumpValue(info, out, true, false);
+        out += ",\"set\":";
+        out += info.set_ ? "true" : "false";
+        out += '}';
+    }
+    out += "}\n";
+}
+
+void CXX_OPT_NAMESPACE::Flag::dumpFlagfile(std::string &out) const {
+    out.clear();
+    for (const FlagInfo *flag : sortedFlags()) {
+        const FlagInfo &info = *flag;
+        if (info.type_ == FlagType::Handler)
+            continue;
+
+        const size_t begin = out.size();
+        out += "--";
+        out += info.name_;
+        // --name==value keeps a value starting with '='
+        out += '=';
+        if (info.type_ == FlagType::String && static_cast<const std::string *>(info.value_)->compare(0, 1, "=") == 0)
+            out += '=';
+        dumpValue(info, out, false, true);
+
+        if (out.find('\n', begin) != std::string::npos)
+            throw CXX_OPT_NAMESPACE::FlagInvalidArgumentError(info.name_ + " value holds a line break");
+        out += '\n';
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::dumpValue(const FlagInfo &info, std::string &out, bool json, bool current) const {
+    char number[32];
+
+    switch (info.type_) {
+        case FlagType::String: {
+            const std::string &value = current ? *static_cast<const std::string *>(info.value_) : info.default_string_;
+            if (json) {
+                out += '"';
+                appendJsonString(out, value);
+                out += '"';
+            } else {
+                out += value;
+            }
+        } break;
+        case FlagType::Int: {
+            std::snprintf(number, sizeof number, "%d", current ? *static_cast<const int *>(info.value_) : info.default_.int_);
+            out += number;
+        } break;
+        case FlagType::Bool: {
+            out += (current ? *static_cast<const bool *>(info.value_) : info.default_.bool_) ? "true" : "false";
+        } break;
+        case FlagType::Float: {
+            float value = current ? *static_cast<const float *>(info.value_) : info.default_.float_;
+            // JSON has no nan / inf, strtof reads them back from a flagfile.
+            if (json && !std::isfinite(value)) {
+                out += "null";
+            } else {
+                // 9 significant digits round-trip any float
+                std::snprintf(number, sizeof number, "%.9g", value);
+                out += number;
+            }
+        } break;
+        case FlagType::Handler:
+            break;
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::writeDump(int fd) const {
+    const char *data = dump_.data();
+    size_t size = dump_.size();
+
+    // one write, more only if a pipe or socket takes it partially.
+    while (size != 0) {
+        ptrdiff_t n = CXX_OPT_WRITE(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw CXX_OPT_NAMESPACE::ParseError(std::string("write dump: ") + std::strerror(errno));
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+void CXX_OPT_NAMESPACE::Flag::handlerOrder(HandlerOrder order) noexcept {
+    handler_order_ = order;
+}
+
+void CXX_OPT_NAMESPACE::Flag::stopAtDoubleDash(bool enable) noexcept {
+    stop_at_double_dash_ = enable;
+}
 
-    flags_[info] = nullptr;
+void CXX_OPT_NAMESPACE::Flag::stopAtFirstArg(bool enable) noexcept {
+    stop_at_first_arg_ = enable;
 }
 
-std::vector<std::string> CXX_OPT_NAMESPACE::Flag::args() {
-    return std::vector<std::string>();
+const CXX_OPT_NAMESPACE::Args &CXX_OPT_NAMESPACE::Flag::args() const noexcept {
+    return args_;
 }
 
-std::string CXX_OPT_NAMESPACE::Flag::arg(size_t index) {
+const char *CXX_OPT_NAMESPACE::Flag::arg(size_t index) const {
     return args_.at(index);
 }
 
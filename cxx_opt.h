@@ -30,9 +30,19 @@
  */
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <string>
+#include <cstddef>
 #include <stdexcept>
 
 #define CXX_OPT_NAMESPACE cxxopt
@@ -57,60 +67,237 @@ namespace CXX_OPT_NAMESPACE {
     DEFINE_EXCEPTION(FlagInvalidArgumentError, "flag invalid argument ")
     // parse error for xxxx
     DEFINE_EXCEPTION(ParseError, "parse error ")
+    // duplicate flag names for merge
+    DEFINE_EXCEPTION(FlagConflictError, "flag conflict ")
 
     /*
-     * @param name: name of the flag, e.g. --name
-     * @param value: value of the flag, e.g. value
+     * ASCII case folding policy of a flag, combine with |.
+     *  Exact: name and value match byte for byte
+     *  Name:  -Verbose matches flag verbose
+     *  Value: bool values TRUE, False, ... ; string values stored lower case
+     */
+    enum class CaseFold { Exact = 0, Name = 1, Value = 2, All = 3 };
+
+    inline CaseFold operator|(CaseFold lhs, CaseFold rhs) noexcept {
+        return static_cast<CaseFold>(static_cast<int>(lhs) | static_cast<int>(rhs));
+    }
+
+    /*
+     * Non-owning view of the positional arguments left over by Flag::parse.
      *
-     * @format
-     *  -name=value
-     *  -name value
-     *  --name==value
-     *  --name value 
+     * Elements point straight into the argv array handed to parse, so the
+     * array must outlive the view. Positionals found between flags are kept
+     * as pointers; everything after a terminator (see Flag::stopAtDoubleDash
+     * and Flag::stopAtFirstArg) is kept as a single unscanned span of argv.
+     */
+    class Args {
+    public:
+        class const_iterator {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef const char *value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const char *const *pointer;
+            typedef const char *const &reference;
+
+            const_iterator() noexcept : args_(nullptr), index_(0) {}
+            const_iterator(const Args *args, size_t index) noexcept : args_(args), index_(index) {}
+
+            reference operator*() const noexcept { return args_->element(index_); }
+            pointer operator->() const noexcept { return &args_->element(index_); }
+            const_iterator &operator++() noexcept { ++index_; return *this; }
+            const_iterator operator++(int) noexcept { const_iterator it = *this; ++index_; return it; }
+            bool operator==(const const_iterator &rhs) const noexcept { return index_ == rhs.index_; }
+            bool operator!=(const const_iterator &rhs) const noexcept { return index_ != rhs.index_; }
+
+        private:
+            const Args *args_;
+            size_t index_;
+        };
+
+        Args() noexcept : tail_(nullptr), tail_size_(0) {}
+
+        size_t size() const noexcept { return scattered_.size() + tail_size_; }
+        bool empty() const noexcept { return size() == 0; }
+
+        const char *operator[](size_t index) const noexcept { return element(index); }
+        const char *at(size_t index) const;
+
+        const_iterator begin() const noexcept { return const_iterator(this, 0); }
+        const_iterator end() const noexcept { return const_iterator(this, size()); }
+
+    private:
+        friend class Flag;
+
+        void clear() noexcept;
+        // the stored pointer, iterators hand out references to it
+        const char *const &element(size_t index) const noexcept {
+            return index < scattered_.size() ? scattered_[index] : tail_[index - scattered_.size()];
+        }
+
+        std::vector<const char *> scattered_;   // positionals interleaved with flags
+        const char *const *tail_;                // unscanned tail after a terminator
+        size_t tail_size_;
+    };
+
+    /*
+     * Callable of a handler flag, void (void *context), stored inline in a
+     * fixed buffer: registering or copying it never allocates. A capture
+     * larger than kCapacity fails to compile, capture a pointer instead.
+     */
+    class FlagHandler {
+    public:
+        static const size_t kCapacity = 8 * sizeof(void *);
+
+        FlagHandler() noexcept : invoke_(nullptr), manage_(nullptr) {}
+        FlagHandler(std::nullptr_t) noexcept : invoke_(nullptr), manage_(nullptr) {}
+
+        template <typename F, typename Fn = typename std::decay<F>::type,
+                  typename = typename std::enable_if<!std::is_same<Fn, FlagHandler>::value>::type>
+        FlagHandler(F &&f) : invoke_(nullptr), manage_(nullptr) {
+            static_assert(sizeof(Fn) <= kCapacity, "handler capture too large for FlagHandler");
+            static_assert(alignof(Fn) <= alignof(Storage), "handler capture over-aligned for FlagHandler");
+            if (isNull(f))
+                return;
+            new (&storage_) Fn(std::forward<F>(f));
+            invoke_ = &invoke<Fn>;
+            manage_ = &manage<Fn>;
+        }
+
+        FlagHandler(const FlagHandler &rhs) : invoke_(nullptr), manage_(nullptr) { *this = rhs; }
+        FlagHandler &operator=(const FlagHandler &rhs) {
+            if (this != &rhs) {
+                reset();
+                if (rhs.manage_ != nullptr)
+                    rhs.manage_(&storage_, &rhs.storage_);
+                invoke_ = rhs.invoke_;
+                manage_ = rhs.manage_;
+            }
+            return *this;
+        }
+        ~FlagHandler() { reset(); }
+
+        void operator()(void *context) const { invoke_(&storage_, context); }
+        explicit operator bool() const noexcept { return invoke_ != nullptr; }
+        bool operator==(std::nullptr_t) const noexcept { return invoke_ == nullptr; }
+
+    private:
+        typedef typename std::aligned_storage<kCapacity, alignof(std::max_align_t)>::type Storage;
+
+        template <typename Fn>
+        static void invoke(const void *storage, void *context) {
+            (*static_cast<Fn *>(const_cast<void *>(storage)))(context);
+        }
+        // copy source into storage, or destroy storage for a null source
+        template <typename Fn>
+        static void manage(void *storage, const void *source) {
+            if (source != nullptr)
+                new (storage) Fn(*static_cast<const Fn *>(source));
+            else
+                static_cast<Fn *>(storage)->~Fn();
+        }
+
+        // empty callables stay null, registerHandler rejects them
+        template <typename Fn>
+        static bool isNull(const Fn &) noexcept { return false; }
+        template <typename Signature>
+        static bool isNull(const std::function<Signature> &fn) noexcept { return !fn; }
+        static bool isNull(void (*fn)(void *)) noexcept { return fn == nullptr; }
+
+        void reset() noexcept {
+            if (manage_ != nullptr)
+                manage_(&storage_, nullptr);
+            invoke_ = nullptr;
+            manage_ = nullptr;
+        }
+
+        Storage storage_;
+        void (*invoke_)(const void *, void *);
+        void (*manage_)(void *, const void *);
+    };
+
+    /*
+     * When handler flags run, see Flag::handlerOrder.
+     *  Inline:   at their token, while parsing
+     *  Argv:     after the whole command line parsed, in command line order
+     *  Priority: after the whole command line parsed, higher priority first,
+     *            command line order among equals
+     */
+    enum class HandlerOrder { Inline, Argv, Priority };
+
+    /*
+     * Registry of flags, usable on its own to build a group of flags, e.g.
+     * one per library, that the application merges into its Flag.
      *
-     * @exception
-     *  FlagContainsEqualError
-     *  InvalidBooleanValueError
+     * Flags live in a sharded hash registry. register*, unregisterFlag and
+     * merge may run concurrently from several threads (e.g. plugins loaded in
+     * parallel), lookups during parse take no lock and must not overlap them.
+     * Registering a name again replaces the flag. A name differing from a
+     * registered one by case only, where either of them folds CaseFold::Name,
+     * throws FlagInvalidArgumentError.
      */
-    class Flag {
+    class FlagSet {
     public:
 
-        Flag();
-        ~Flag();
+        FlagSet();
+        virtual ~FlagSet();
 
-        void banner(const std::string &banner);
+        // string values are stored byte exact unless folded with CaseFold::Value
+        void registerString(const std::string &name, std::string *value, const std::string &help = "", CaseFold fold = CaseFold::Exact);
+        void registerInt(const std::string &name, int *value, const std::string &help = "", CaseFold fold = CaseFold::Exact);
+        void registerBool(const std::string &name, bool *value, const std::string &help = "", CaseFold fold = CaseFold::Value);
+        void registerFloat(const std::string &name, float *value, const std::string &help = "", CaseFold fold = CaseFold::Exact);
+        void registerHandler(const std::string &name, FlagHandler handler, void *context, const std::string &help = "", CaseFold fold = CaseFold::Exact, int priority = 0);
 
-        void parse(int argc, char **argv);
+        // remove a flag, e.g. on dlclose of the plugin that registered it
+        bool unregisterFlag(const std::string &name);
 
-        void printDefaults() const noexcept;
+        /*
+         * Single character alias of a registered flag, getopt style:
+         *  -x -v -f file, clustered -xvf file, attached value -ofile
+         * A -token matching a long name is always the long flag. Aliases
+         * belong to this set, merge does not carry them over.
+         *
+         * @exception
+         *  FlagInvalidArgumentError: shortName not [A-Za-z0-9], name not registered
+         */
+        void alias(char shortName, const std::string &name);
 
-        void registerString(const std::string &name, std::string *value, const std::string &help = "");
-        void registerInt(const std::string &name, int *value, const std::string &help = "");
-        void registerBool(const std::string &name, bool *value, const std::string &help = "");
-        void registerFloat(const std::string &name, float *value, const std::string &help = "");
-        void registerHandler(const std::string &name, std::function<void (void *)> handler, void *context, const std::string &help = "");
+        /*
+         * Copy every flag of set into this one, named prefix.name, or name for
+         * an empty prefix. Linear in the size of set, nothing is merged when a
+         * name already exists here.
+         *
+         * @exception
+         *  FlagConflictError: lists every conflicting name
+         *  FlagContainsEqualError: prefix contains '='
+         */
+        void merge(const FlagSet &set, const std::string &prefix = "");
 
-        std::vector<std::string> args();
-        std::string arg(size_t index);
+        size_t size() const;
 
     protected:
-        void showHelp() const noexcept;
-
         enum class FlagType { String, Int, Bool, Float, Handler };
         const char *flagTypeToString(FlagType type) const noexcept {
             static const char *types[] = { "string", "int", "bool", "float", "" };
             return types[(int)type];
         }
         struct FlagInfo {
-            FlagType type_;
+            FlagType type_ = FlagType::String;
             std::string name_;
             std::string help_;
-            std::function<void (void *)> handler_;
-            void *context;
+            CaseFold fold_ = CaseFold::Exact;
+            void *value_ = nullptr;
+            FlagHandler handler_;
+            void *context = nullptr;
+            int priority_ = 0;   // HandlerOrder::Priority
+
+            bool set_ = false;     // assigned by a parse
+            char short_ = '\0';    // alias, '\0' for none
 
+            std::string default_string_;
             union {
-                const char *string_;
-                int int_;
+                int int_ = 0;
                 bool bool_;
                 float float_;
             } default_;
@@ -120,11 +307,221 @@ namespace CXX_OPT_NAMESPACE {
             }
         };
 
+        // a token after one pass: dashes, name and its hash, attached value
+        struct Scan {
+            const char *name_;    // after the dashes
+            size_t size_;         // up to '=' or the end, 0 for no flag
+            size_t hash_;         // hashName of the name
+            const char *value_;   // after '=' or "==", nullptr without
+            int dashes_;          // 0, 1 or 2
+        };
+        static void scan(const char *token, Scan *out) noexcept;
+
+        FlagInfo *lookup(const Scan &scan);
+        FlagInfo *lookupShort(char name) const noexcept {
+            return static_cast<unsigned char>(name) < 128 ? shorts_[static_cast<unsigned char>(name)] : nullptr;
+        }
+        // snapshot sorted by name
+        std::vector<const FlagInfo *> sortedFlags() const;
+        // alias of info, '\0' for none; short_ only read under shorts_mutex_
+        char shortOf(const FlagInfo &info) const;
+        // bumped by every registry change, FlagInfo pointers looked up
+        // before a change may be stale
+        size_t generation() const noexcept { return generation_.load(std::memory_order_relaxed); }
+
+    private:
+        // registry key, points into FlagInfo::name_ or into a parsed token
+        struct NameKey {
+            const char *data_;
+            size_t size_;
+            size_t hash_;   // ASCII case insensitive, see hashName
+            bool fold_;     // compare ASCII case insensitive
+        };
+        struct NameKeyHash {
+            size_t operator()(const NameKey &key) const noexcept { return key.hash_; }
+        };
+        struct NameKeyEqual {
+            bool operator()(const NameKey &lhs, const NameKey &rhs) const noexcept;
+        };
+        typedef std::unordered_map<NameKey, std::unique_ptr<FlagInfo>, NameKeyHash, NameKeyEqual> FlagMap;
+
+        struct Shard {
+            mutable std::mutex mutex_;   // registration only, parse never locks
+            FlagMap flags_;
+        };
+        static const size_t kShardCount = 16;
+
+        static NameKey makeKey(const char *name, size_t size, size_t hash, bool fold) noexcept;
+        static NameKey makeKey(const char *name, size_t size, bool fold) noexcept;
+        static NameKey makeKey(const FlagInfo &info) noexcept;
+        Shard &shardOf(const NameKey &key) noexcept { return shards_[(key.hash_ >> 8) % kShardCount]; }
+
+        void insert(const FlagInfo &info);
+        // caller holds the shard lock
+        void insertLocked(Shard &shard, std::unique_ptr<FlagInfo> flag);
+        // aliases of from to to, or dropped for a null to; shard lock held
+        void moveShort(const FlagInfo *from, FlagInfo *to);
+        // as moveShort, caller holds shorts_mutex_ too
+        void moveShortLocked(const FlagInfo *from, FlagInfo *to) noexcept;
+
+        Shard shards_[kShardCount];
+        // guards shorts_ and every FlagInfo::short_, after a shard mutex, never before
+        mutable std::mutex shorts_mutex_;
+        FlagInfo *shorts_[128];
+        std::atomic<size_t> generation_;
+    };
+
+    /*
+     * @param name: name of the flag, e.g. --name
+     * @param value: value of the flag, e.g. value
+     *
+     * @format
+     *  -name=value
+     *  -name value
+     *  --name==value
+     *  --name value 
+     *  -x -xvf file -ofile   (see alias)
+     *  --                    (see stopAtDoubleDash)
+     *
+     * Tokens that match no registered flag are positional arguments, see args().
+     *
+     * @exception
+     *  FlagContainsEqualError
+     *  InvalidBooleanValueError
+     */
+    class Flag : public FlagSet {
+    public:
+
+        Flag();
+        ~Flag();
+
+        void banner(const std::string &banner);
+
+        void parse(int argc, char **argv);
+
+        /*
+         * Parse tokens streamed from fd, one token per delimiter ('\n', or
+         * '\0' for find -print0 style input), with the rules of parse().
+         *
+         * Input is read into one fixed buffer of chunkSize + 1 bytes (a token
+         * and its delimiter), so memory stays bounded however long the stream
+         * is. Flags apply as they arrive. Positionals go to handler in batches
+         * of at most batchSize; a batch is handed out at the latest when its
+         * chunk is consumed and is only valid during the call.
+         *
+         * Like parse() it starts a new parse, args() of a previous one is
+         * cleared; called from a handler while a parse runs it joins that
+         * parse instead.
+         *
+         * @exception
+         *  ParseError: read failure, or a token longer than chunkSize bytes
+         */
+        void parseStream(int fd,
+                         const std::function<void (const Args &)> &handler,
+                         char delimiter = '\n',
+                         size_t chunkSize = 64 * 1024,
+                         size_t batchSize = 1024);
+
+        /*
+         * Parse a flagfile (response file), one token per line, with the
+         * rules of parse(). The file stays in memory until the next parse,
+         * args() points into it.
+         *
+         * Like parse() it starts a new parse: args() holds the positionals of
+         * the file only. Called from a handler while a parse runs (a -flagfile
+         * or include flag), it joins that parse instead: its positionals are
+         * appended to args() and deferred handlers run when the outermost
+         * parse completes.
+         *
+         * threads > 1 (0 for every core) splits large files at line breaks,
+         * tokenizes, looks up and converts values on worker threads, then
+         * applies the results in file order: last one wins, handlers and
+         * errors happen exactly as with threads == 1. An inline handler that
+         * changes the registry leaves the rest of the file to one thread.
+         *
+         * @exception
+         *  ParseError: the file cannot be read
+         */
+        void parseFlagfile(const std::string &path, unsigned threads = 1);
+
+        void printDefaults() const noexcept;
+
+        /*
+         * Effective configuration of every value flag (handlers are skipped),
+         * sorted by name, serialized into one reused buffer and written to fd
+         * with a single write.
+         *
+         * dumpJson:     {"name":{"type":"int","value":8,"default":4,"set":true},...}
+         * dumpFlagfile: --name=value lines that parseFlagfile reads back
+         *
+         * @exception
+         *  ParseError: write failure
+         *  FlagInvalidArgumentError: dumpFlagfile of a string holding a line break
+         */
+        void dumpJson(int fd) const;
+        void dumpFlagfile(int fd) const;
+        // same, into out
+        void dumpJson(std::string &out) const;
+        void dumpFlagfile(std::string &out) const;
+
+        // Inline by default; deferred handlers never run for a failed parse
+        void handlerOrder(HandlerOrder order) noexcept;
+
+        // stop flag parsing at "--", the rest of argv is positional
+        void stopAtDoubleDash(bool enable = true) noexcept;
+        // stop flag parsing at the first positional, the rest of argv is positional
+        void stopAtFirstArg(bool enable = true) noexcept;
+
+        // positional arguments of the last parse and the parses nested in its
+        // handlers, valid while its argv lives
+        const Args &args() const noexcept;
+        const char *arg(size_t index) const;
+
+    protected:
+        void showHelp() const noexcept;
+
     private:
+        // a deferred handler call, a copy: the flag may be re-registered or
+        // removed by a handler running before it
+        struct Deferred {
+            FlagHandler handler_;
+            void *context_;
+            int priority_;
+        };
+
+        union Value {
+            int int_;
+            bool bool_;
+            float float_;
+        };
+
+        struct Nesting;
+        struct Tokenizer;
+        struct Token;
+        struct Step;
+
+        void parseBuffer(char *data, size_t size, unsigned threads);
+        // convert steps on up to parts threads, store them in order
+        void applySteps(std::vector<Step> &steps, size_t parts);
+        static bool needsValue(const FlagInfo &info) noexcept;
+        void apply(FlagInfo &info, const char *token, const char *value);
+        // value text to Value, FlagInvalidArgumentError on bad text
+        static void convert(const FlagInfo &info, const char *token, const char *value, Value *converted);
+        void store(FlagInfo &info, const char *value, const Value &converted);
+        void runDeferred();
+        void dumpValue(const FlagInfo &info, std::string &out, bool json, bool current) const;
+        void writeDump(int fd) const;
+
         std::string cmd_;
         std::string banner_;
-        std::map<FlagInfo/*flag*/, void */*save_pointer*/> flags_;
-        std::vector<std::string> args_;
+        Args args_;
+        std::deque<std::vector<char>> flagfiles_;   // tokens of the flagfiles of the last parse
+        mutable std::string dump_;     // reused by dumpJson / dumpFlagfile
+        std::vector<Deferred> deferred_;           // handlers of the current parse
+        unsigned depth_;                           // parses running, see Nesting
+        HandlerOrder handler_order_;
+        bool stop_at_double_dash_;
+        bool stop_at_first_arg_;
     };
 }
 
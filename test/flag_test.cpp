@@ -30,8 +30,25 @@
  */
 
 #include <gtest/gtest.h>
+#include <array>
+#include <cstdio>
+#include <thread>
 #include "../cxx_opt.h"
 
+#ifndef _WIN32
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+// temporary file holding content, rewound for reading through its fd
+static std::FILE *streamOf(const std::string &content) {
+    std::FILE *file = std::tmpfile();
+    std::fwrite(content.data(), 1, content.size(), file);
+    std::fflush(file);
+    std::rewind(file);
+    return file;
+}
+
 TEST(Flag, exception) {
     bool occur = false;
 
@@ -452,3 +469,963 @@ TEST(Flag, parse_type_handler_with_context) {
 
     EXPECT_EQ(version_show, true);
 }
+
+TEST(Flag, args_view) {
+    const char *cmd[] = {
+        "./cmd",
+        "a.txt",
+        "-name",
+        "value",
+        "b.txt",
+        "--",
+        "-name=c.txt"
+    };
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::string name = "default_name";
+    flag.registerString("name", &name);
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    EXPECT_EQ(name, "c.txt");
+    ASSERT_EQ(flag.args().size(), 3u);
+    EXPECT_EQ(flag.arg(0), cmd[1]) << "TEST: positional points into argv, no copy.";
+    EXPECT_EQ(flag.arg(1), cmd[4]);
+    EXPECT_STREQ(flag.arg(2), "--");
+
+    bool occur = false;
+    try {
+        flag.arg(3);
+    } catch (const std::out_of_range &) {
+        occur = true;
+    }
+    EXPECT_TRUE(occur) << "TEST: arg index out of range.";
+
+    std::vector<std::string> collected(flag.args().begin(), flag.args().end());
+    EXPECT_EQ(collected, std::vector<std::string>({ "a.txt", "b.txt", "--" }));
+
+    /* forward iterator: multi-pass, references into the view */
+    static_assert(std::is_same<std::iterator_traits<CXX_OPT_NAMESPACE::Args::const_iterator>::reference, const char *const &>::value,
+                  "reference into the view");
+    CXX_OPT_NAMESPACE::Args::const_iterator it = flag.args().begin(), copy = it;
+    EXPECT_EQ(&*it, &*copy);
+    EXPECT_EQ(*++it, cmd[4]);
+    EXPECT_EQ(*copy, cmd[1]);
+    EXPECT_EQ(copy.operator->(), &*copy);
+    EXPECT_TRUE(CXX_OPT_NAMESPACE::Args::const_iterator() == CXX_OPT_NAMESPACE::Args::const_iterator());
+    EXPECT_EQ(std::distance(flag.args().begin(), flag.args().end()), 3);
+
+    /* args of the last parse only */
+    flag.parse(1, (char **)&cmd);
+    EXPECT_TRUE(flag.args().empty());
+}
+
+TEST(Flag, args_stop_at_double_dash) {
+    const char *cmd[] = {
+        "./cmd",
+        "a.txt",
+        "-name=value",
+        "--",
+        "-name=other",
+        "b.txt"
+    };
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::string name = "default_name";
+    flag.registerString("name", &name);
+    flag.stopAtDoubleDash();
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    EXPECT_EQ(name, "value");
+    ASSERT_EQ(flag.args().size(), 3u);
+    EXPECT_EQ(flag.arg(0), cmd[1]);
+    EXPECT_EQ(flag.arg(1), cmd[4]) << "TEST: flags after '--' are positional.";
+    EXPECT_EQ(flag.arg(2), cmd[5]);
+}
+
+TEST(Flag, args_stop_at_first_arg) {
+    const char *cmd[] = {
+        "./cmd",
+        "-name=value",
+        "a.txt",
+        "-name=other",
+        "b.txt"
+    };
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::string name = "default_name";
+    flag.registerString("name", &name);
+    flag.stopAtFirstArg();
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    EXPECT_EQ(name, "value");
+    ASSERT_EQ(flag.args().size(), 3u);
+    EXPECT_EQ(flag.arg(0), cmd[2]);
+    EXPECT_EQ(flag.arg(1), cmd[3]) << "TEST: flags after the first positional are positional.";
+    EXPECT_EQ(flag.arg(2), cmd[4]);
+}
+
+TEST(Flag, parse_stream) {
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::string name = "default_name";
+    int age = 0;
+    bool male = false;
+    flag.registerString("name", &name);
+    flag.registerInt("age", &age);
+    flag.registerBool("male", &male);
+
+    std::vector<std::string> paths;
+    size_t batches = 0;
+    auto collect = [&](const CXX_OPT_NAMESPACE::Args &args) {
+        EXPECT_LE(args.size(), 2u);
+        paths.insert(paths.end(), args.begin(), args.end());
+        batches++;
+    };
+
+    {
+        GTEST_LOG_(INFO) << "TEST: newline delimited, value token split across chunks.";
+        std::FILE *file = streamOf("-name\nvalue\na.txt\n\n-male\nb.txt\n-age=20\nc.txt");
+        flag.parseStream(fileno(file), collect, '\n', 8, 2);
+        std::fclose(file);
+
+        EXPECT_EQ(name, "value");
+        EXPECT_EQ(age, 20);
+        EXPECT_EQ(male, true);
+        EXPECT_EQ(paths, std::vector<std::string>({ "a.txt", "b.txt", "c.txt" }));
+        EXPECT_GE(batches, 2u);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: NUL delimited keeps newlines in tokens.";
+        paths.clear();
+        std::FILE *file = streamOf(std::string("-name=x\ny\0a\nb\0", 13));
+        flag.parseStream(fileno(file), collect, '\0');
+        std::fclose(file);
+
+        EXPECT_EQ(name, "x\ny");
+        EXPECT_EQ(paths, std::vector<std::string>({ "a\nb" }));
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: token longer than chunk size.";
+        bool occur = false;
+        std::FILE *file = streamOf("a.txt\nvery_long_path.txt\n");
+        try {
+            flag.parseStream(fileno(file), collect, '\n', 8);
+        } catch (const CXX_OPT_NAMESPACE::ParseError &) {
+            occur = true;
+        }
+        std::fclose(file);
+        EXPECT_TRUE(occur);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: tokens of exactly chunk size, one byte over fails.";
+        paths.clear();
+        std::FILE *file = streamOf("abcdefgh\nijklmnop\n12345678");
+        flag.parseStream(fileno(file), collect, '\n', 8);
+        std::fclose(file);
+        EXPECT_EQ(paths, std::vector<std::string>({ "abcdefgh", "ijklmnop", "12345678" }));
+
+        file = streamOf("abcdefgh\nabcdefghi");
+        EXPECT_THROW(flag.parseStream(fileno(file), collect, '\n', 8), CXX_OPT_NAMESPACE::ParseError);
+        std::fclose(file);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: flag value missing at end of stream.";
+        bool occur = false;
+        std::FILE *file = streamOf("a.txt\n-age\n");
+        try {
+            flag.parseStream(fileno(file), collect);
+        } catch (const CXX_OPT_NAMESPACE::FlagInvalidArgumentError &) {
+            occur = true;
+        }
+        std::fclose(file);
+        EXPECT_TRUE(occur);
+    }
+}
+
+#ifndef _WIN32
+TEST(Flag, parse_stream_before_eof) {
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(write(fds[1], "a.txt\n", 6), 6);
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::vector<std::string> paths;
+    flag.parseStream(fds[0], [&](const CXX_OPT_NAMESPACE::Args &args) {
+            paths.insert(paths.end(), args.begin(), args.end());
+            if (paths.size() == 1) {
+                /* the writer is still open: the first path came before EOF */
+                EXPECT_EQ(write(fds[1], "b.txt\n", 6), 6);
+                close(fds[1]);
+            }
+        });
+    close(fds[0]);
+
+    EXPECT_EQ(paths, std::vector<std::string>({ "a.txt", "b.txt" }));
+}
+#endif
+
+TEST(Flag, case_fold) {
+    {
+        GTEST_LOG_(INFO) << "TEST: string values are byte exact by default.";
+        const char *cmd[] = {
+            "./cmd",
+            "-path=/Data/Report.TXT",
+            "-Path=/tmp"
+        };
+
+        CXX_OPT_NAMESPACE::Flag flag;
+        std::string path;
+        flag.registerString("path", &path);
+        flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+        EXPECT_EQ(path, "/Data/Report.TXT");
+        ASSERT_EQ(flag.args().size(), 1u) << "TEST: names are exact by default.";
+        EXPECT_STREQ(flag.arg(0), "-Path=/tmp");
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: case insensitive names and values.";
+        const char *cmd[] = {
+            "./cmd",
+            "--ENABLE_EXPERIMENTAL_FEATURE_X=TRUE",
+            "-Mode=Fast_And_Loose_Mode_Number_One"
+        };
+
+        CXX_OPT_NAMESPACE::Flag flag;
+        bool feature = false;
+        std::string mode;
+        flag.registerBool("enable_experimental_feature_x", &feature, "", CXX_OPT_NAMESPACE::CaseFold::Name | CXX_OPT_NAMESPACE::CaseFold::Value);
+        flag.registerString("mode", &mode, "", CXX_OPT_NAMESPACE::CaseFold::All);
+        flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+        EXPECT_EQ(feature, true);
+        EXPECT_EQ(mode, "fast_and_loose_mode_number_one");
+        EXPECT_TRUE(flag.args().empty());
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: exact bool values reject TRUE.";
+        const char *cmd[] = {
+            "./cmd",
+            "-strict=TRUE"
+        };
+
+        CXX_OPT_NAMESPACE::Flag flag;
+        bool strict = false;
+        flag.registerBool("strict", &strict, "", CXX_OPT_NAMESPACE::CaseFold::Exact);
+
+        bool occur = false;
+        try {
+            flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+        } catch (const CXX_OPT_NAMESPACE::FlagInvalidArgumentError &) {
+            occur = true;
+        }
+        EXPECT_TRUE(occur);
+    }
+}
+
+TEST(Flag, case_fold_clash) {
+    CXX_OPT_NAMESPACE::Flag flag;
+    bool upper = false, lower = false, exact = false;
+    flag.registerBool("Verbose", &upper);
+    flag.registerBool("VERBOSE", &exact);
+    size_t size = flag.size();
+
+    EXPECT_THROW(flag.registerBool("verbose", &lower, "", CXX_OPT_NAMESPACE::CaseFold::Name), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+    EXPECT_EQ(flag.size(), size);
+
+    flag.registerBool("quiet", &lower, "", CXX_OPT_NAMESPACE::CaseFold::Name);
+    EXPECT_THROW(flag.registerBool("Quiet", &exact), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+    flag.registerBool("quiet", &exact);   // same name, still replaces
+    EXPECT_EQ(flag.size(), size + 1);
+}
+
+TEST(Flag, concurrent_register) {
+    const int plugins = 8;
+    const int flags_per_plugin = 500;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::vector<std::vector<int>> values(plugins, std::vector<int>(flags_per_plugin, -1));
+    std::vector<std::thread> threads;
+
+    /* every plugin registers its own flags in parallel */
+    for (int p = 0; p < plugins; p++) {
+        threads.emplace_back([&, p]() {
+            for (int i = 0; i < flags_per_plugin; i++)
+                flag.registerInt("p" + std::to_string(p) + ".f" + std::to_string(i), &values[p][i]);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    threads.clear();
+
+    std::vector<std::string> tokens;
+    for (int p = 0; p < plugins; p++)
+        tokens.push_back("-p" + std::to_string(p) + ".f" + std::to_string(p * 7) + "=" + std::to_string(p));
+    std::vector<char *> cmd;
+    cmd.push_back((char *)"./cmd");
+    for (auto &token : tokens)
+        cmd.push_back(&token[0]);
+
+    flag.parse(static_cast<int>(cmd.size()), cmd.data());
+    for (int p = 0; p < plugins; p++) {
+        EXPECT_EQ(values[p][p * 7], p);
+        EXPECT_EQ(values[p][p * 7 + 1], -1);
+    }
+    EXPECT_TRUE(flag.args().empty());
+
+    /* odd plugins are dlclose'd in parallel */
+    for (int p = 1; p < plugins; p += 2) {
+        threads.emplace_back([&, p]() {
+            for (int i = 0; i < flags_per_plugin; i++)
+                EXPECT_TRUE(flag.unregisterFlag("p" + std::to_string(p) + ".f" + std::to_string(i)));
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    EXPECT_FALSE(flag.unregisterFlag("p1.f0"));
+
+    flag.parse(static_cast<int>(cmd.size()), cmd.data());
+    ASSERT_EQ(flag.args().size(), static_cast<size_t>(plugins / 2));
+    EXPECT_STREQ(flag.arg(0), tokens[1].c_str());
+}
+
+TEST(Flag, concurrent_alias) {
+    const int plugins = 4;
+    const int rounds = 200;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    std::vector<int> values(plugins, -1);
+    std::vector<std::thread> threads;
+
+    /* plugins take aliases from each other while flags come and go */
+    for (int p = 0; p < plugins; p++) {
+        threads.emplace_back([&, p]() {
+            const std::string name = "t" + std::to_string(p);
+            for (int i = 0; i < rounds; i++) {
+                flag.registerInt(name, &values[p]);
+                flag.alias(static_cast<char>('a' + (p + i) % plugins), name);
+                flag.registerInt(name, &values[p]);   // keeps the alias
+                if (i % 3 == 0)
+                    flag.unregisterFlag(name);
+            }
+            flag.registerInt(name, &values[p]);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    for (int p = 0; p < plugins; p++)
+        flag.alias(static_cast<char>('a' + p), "t" + std::to_string(p));
+
+    const char *cmd[] = { "./cmd", "-a", "0", "-b", "1", "-c", "2", "-d", "3" };
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    for (int p = 0; p < plugins; p++)
+        EXPECT_EQ(values[p], p);
+    EXPECT_TRUE(flag.args().empty());
+}
+
+TEST(Flag, flag_set_merge) {
+    int pool_size = 4;
+    std::string host = "localhost";
+    bool trace = false;
+
+    CXX_OPT_NAMESPACE::FlagSet db;
+    db.registerInt("pool_size", &pool_size, "connection pool size");
+    db.registerString("host", &host, "database host");
+
+    CXX_OPT_NAMESPACE::FlagSet log;
+    log.registerBool("trace", &trace, "trace logging");
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    size_t builtin = flag.size();
+    flag.merge(db, "db");
+    flag.merge(log);
+    EXPECT_EQ(flag.size(), builtin + 3);
+
+    const char *cmd[] = {
+        "./cmd",
+        "--db.pool_size=8",
+        "-db.host",
+        "db.example.com",
+        "-trace",
+        "-pool_size=16"
+    };
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    EXPECT_EQ(pool_size, 8);
+    EXPECT_EQ(host, "db.example.com");
+    EXPECT_EQ(trace, true);
+    ASSERT_EQ(flag.args().size(), 1u) << "TEST: unprefixed name is not registered.";
+    EXPECT_STREQ(flag.arg(0), "-pool_size=16");
+
+    {
+        GTEST_LOG_(INFO) << "TEST: conflicts are reported and nothing is merged.";
+        int other = 0;
+        CXX_OPT_NAMESPACE::FlagSet cache;
+        cache.registerInt("size", &other);
+        cache.registerInt("pool_size", &other);
+        cache.registerBool("trace", &trace);
+
+        bool occur = false;
+        try {
+            flag.merge(cache, "db");
+        } catch (const CXX_OPT_NAMESPACE::FlagConflictError &e) {
+            occur = true;
+            EXPECT_NE(std::string(e.what()).find("db.pool_size"), std::string::npos);
+        }
+        EXPECT_TRUE(occur);
+        EXPECT_EQ(flag.size(), builtin + 3);
+
+        occur = false;
+        try {
+            flag.merge(log);
+        } catch (const CXX_OPT_NAMESPACE::FlagConflictError &) {
+            occur = true;
+        }
+        EXPECT_TRUE(occur) << "TEST: conflict without prefix.";
+
+        EXPECT_THROW(flag.merge(cache, "a=b"), CXX_OPT_NAMESPACE::FlagContainsEqualError);
+        EXPECT_EQ(flag.size(), builtin + 3) << "TEST: prefix with '=' merges nothing.";
+    }
+}
+
+// flags registered the same way into every parser under comparison
+struct FlagfileConfig {
+    int ints[16] = {};
+    float floats[16] = {};
+    bool bools[16] = {};
+    std::string strings[16];
+    std::vector<int> trace;   // ints[0] each time the handler runs
+
+    void registerInto(CXX_OPT_NAMESPACE::Flag &flag) {
+        for (int i = 0; i < 16; i++) {
+            flag.registerInt("i" + std::to_string(i), &ints[i]);
+            flag.registerFloat("f" + std::to_string(i), &floats[i]);
+            flag.registerBool("b" + std::to_string(i), &bools[i]);
+            flag.registerString("s" + std::to_string(i), &strings[i]);
+        }
+        flag.registerHandler("mark", [this](void *) { trace.push_back(ints[0]); }, nullptr);
+    }
+
+    void expectEqual(const FlagfileConfig &rhs) const {
+        for (int i = 0; i < 16; i++) {
+            EXPECT_EQ(ints[i], rhs.ints[i]);
+            EXPECT_EQ(floats[i], rhs.floats[i]);
+            EXPECT_EQ(bools[i], rhs.bools[i]);
+            EXPECT_EQ(strings[i], rhs.strings[i]);
+        }
+        EXPECT_EQ(trace, rhs.trace);
+    }
+};
+
+static void writeFile(const std::string &path, const std::vector<std::string> &tokens) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    for (const auto &token : tokens)
+        std::fprintf(file, "%s\n", token.c_str());
+    std::fclose(file);
+}
+
+TEST(Flag, parse_flagfile_parallel) {
+    const std::string path = "flag_test_flagfile.txt";
+
+    /* a few MB, enough to be split among threads */
+    std::vector<std::string> tokens;
+    for (int i = 0; i < 200000; i++) {
+        switch (i % 7) {
+            case 0: tokens.push_back("-i" + std::to_string(i % 16) + "=" + std::to_string(i)); break;
+            case 1: tokens.push_back("--f" + std::to_string(i % 16)); tokens.push_back(std::to_string(i) + ".5"); break;
+            case 2: tokens.push_back("-b" + std::to_string(i % 16) + (i % 3 ? "=FALSE" : "")); break;
+            case 3: tokens.push_back("-s" + std::to_string(i % 16)); tokens.push_back("Path/" + std::to_string(i)); break;
+            case 4: tokens.push_back("file_" + std::to_string(i) + ".txt"); break;
+            case 5: tokens.push_back(i % 1000 == 5 ? "-mark" : "-unknown=" + std::to_string(i)); break;
+            case 6: tokens.push_back("--i0==" + std::to_string(i)); break;
+        }
+    }
+    writeFile(path, tokens);
+
+    std::vector<char *> argv;
+    argv.push_back((char *)"./cmd");
+    for (auto &token : tokens)
+        argv.push_back(&token[0]);
+
+    FlagfileConfig serial, single, parallel;
+    CXX_OPT_NAMESPACE::Flag serial_flag, single_flag, parallel_flag;
+    serial.registerInto(serial_flag);
+    single.registerInto(single_flag);
+    parallel.registerInto(parallel_flag);
+
+    serial_flag.parse(static_cast<int>(argv.size()), argv.data());
+    single_flag.parseFlagfile(path, 1);
+    parallel_flag.parseFlagfile(path, 4);
+
+    EXPECT_FALSE(serial.trace.empty());
+    serial.expectEqual(single);
+    serial.expectEqual(parallel);
+
+    std::vector<std::string> serial_args(serial_flag.args().begin(), serial_flag.args().end());
+    std::vector<std::string> parallel_args(parallel_flag.args().begin(), parallel_flag.args().end());
+    EXPECT_EQ(serial_args, parallel_args);
+
+    {
+        GTEST_LOG_(INFO) << "TEST: the first bad value fails both, after the same assignments.";
+        size_t middle = tokens.size() / 2;
+        while (tokens[middle].compare(0, 5, "file_") != 0)
+            middle++;
+        tokens[middle] = "-i3=bad";
+        writeFile(path, tokens);
+        argv.assign(1, (char *)"./cmd");
+        for (auto &token : tokens)
+            argv.push_back(&token[0]);
+
+        FlagfileConfig serial_bad, parallel_bad;
+        CXX_OPT_NAMESPACE::Flag serial_bad_flag, parallel_bad_flag;
+        serial_bad.registerInto(serial_bad_flag);
+        parallel_bad.registerInto(parallel_bad_flag);
+
+        EXPECT_THROW(serial_bad_flag.parse(static_cast<int>(argv.size()), argv.data()),
+                     CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+        EXPECT_THROW(parallel_bad_flag.parseFlagfile(path, 4), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+        serial_bad.expectEqual(parallel_bad);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: an inline handler re-registering a later flag.";
+        tokens.assign({ "-n=1", "-reload", "-n=3", "-extra=4", "x.txt" });
+        writeFile(path, tokens);
+        argv.assign(1, (char *)"./cmd");
+        for (auto &token : tokens)
+            argv.push_back(&token[0]);
+
+        for (unsigned threads : { 0u, 1u, 4u }) {
+            int old_n = 0, new_n = 0, extra = 0;
+            CXX_OPT_NAMESPACE::Flag flag;
+            flag.registerInt("n", &old_n);
+            flag.registerHandler("reload", [&](void *) {
+                    flag.registerInt("n", &new_n);
+                    flag.registerInt("extra", &extra);
+                }, nullptr);
+
+            if (threads == 0)
+                flag.parse(static_cast<int>(argv.size()), argv.data());
+            else
+                flag.parseFlagfile(path, threads);
+
+            EXPECT_EQ(old_n, 1);
+            EXPECT_EQ(new_n, 3);
+            EXPECT_EQ(extra, 4) << "TEST: registered by the handler, no longer positional.";
+            ASSERT_EQ(flag.args().size(), 1u);
+            EXPECT_STREQ(flag.arg(0), "x.txt");
+        }
+    }
+
+    std::remove(path.c_str());
+
+    EXPECT_THROW(parallel_flag.parseFlagfile(path), CXX_OPT_NAMESPACE::ParseError);
+}
+
+TEST(Flag, parse_flagfile_nested) {
+    const std::string outer = "flag_test_outer.txt";
+    const std::string inner = "flag_test_inner.txt";
+    // the name is stored after the include parsed and freed nothing
+    writeFile(outer, { "-include", "-name=" + std::string(100, 'o'), "outer.txt" });
+    writeFile(inner, { "-count=2", "inner.txt" });
+
+    const char *cmd[] = {
+        "./cmd",
+        "a.txt",
+        "-flagfile",
+    };
+
+    const CXX_OPT_NAMESPACE::HandlerOrder orders[] = {
+        CXX_OPT_NAMESPACE::HandlerOrder::Inline,
+        CXX_OPT_NAMESPACE::HandlerOrder::Argv,
+    };
+    for (auto order : orders) {
+        CXX_OPT_NAMESPACE::Flag flag;
+        std::string name;
+        int count = 0;
+        flag.registerString("name", &name);
+        flag.registerInt("count", &count);
+        flag.registerHandler("flagfile", [&](void *) { flag.parseFlagfile(outer); }, nullptr);
+        flag.registerHandler("include", [&](void *) { flag.parseFlagfile(inner); }, nullptr);
+        flag.handlerOrder(order);
+
+        flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+        EXPECT_EQ(name, std::string(100, 'o'));
+        EXPECT_EQ(count, 2);
+        // inline includes where it stands, deferred after the outer file
+        std::vector<std::string> args(flag.args().begin(), flag.args().end());
+        if (order == CXX_OPT_NAMESPACE::HandlerOrder::Inline)
+            EXPECT_EQ(args, std::vector<std::string>({ "a.txt", "inner.txt", "outer.txt" }));
+        else
+            EXPECT_EQ(args, std::vector<std::string>({ "a.txt", "outer.txt", "inner.txt" }));
+
+        // the next parse starts over
+        flag.parse(2, (char **)&cmd);
+        EXPECT_EQ(flag.args().size(), 1u);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: a flagfile on its own is a new parse.";
+        CXX_OPT_NAMESPACE::Flag flag;
+        int count = 0;
+        flag.registerInt("count", &count);
+        flag.parse(2, (char **)&cmd);
+        ASSERT_EQ(flag.args().size(), 1u);
+
+        flag.parseFlagfile(inner);
+        EXPECT_EQ(count, 2);
+        ASSERT_EQ(flag.args().size(), 1u);
+        EXPECT_STREQ(flag.arg(0), "inner.txt");
+    }
+
+    std::remove(outer.c_str());
+    std::remove(inner.c_str());
+}
+
+TEST(Flag, dump) {
+    std::string path = "/data/\"in\"";
+    std::string token = "=abc=";
+    int port = 80;
+    bool debug = false;
+    float ratio = 0.1f;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerString("path", &path);
+    flag.registerString("db.token", &token);
+    flag.registerInt("port", &port);
+    flag.registerBool("debug", &debug);
+    flag.registerFloat("ratio", &ratio);
+
+    const char *cmd[] = {
+        "./cmd",
+        "-port=443",
+        "-path",
+        "C:\\Data Files\\x"
+    };
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    std::string json;
+    flag.dumpJson(json);
+    EXPECT_EQ(json,
+              "{\"db.token\":{\"type\":\"string\",\"value\":\"=abc=\",\"default\":\"=abc=\",\"set\":false},"
+              "\"debug\":{\"type\":\"bool\",\"value\":false,\"default\":false,\"set\":false},"
+              "\"path\":{\"type\":\"string\",\"value\":\"C:\\\\Data Files\\\\x\",\"default\":\"/data/\\\"in\\\"\",\"set\":true},"
+              "\"port\":{\"type\":\"int\",\"value\":443,\"default\":80,\"set\":true},"
+              "\"ratio\":{\"type\":\"float\",\"value\":0.100000001,\"default\":0.100000001,\"set\":false}}\n");
+
+    {
+        GTEST_LOG_(INFO) << "TEST: dumpFlagfile round-trips through parseFlagfile.";
+        const std::string flagfile = "flag_test_dump.txt";
+        std::FILE *file = std::fopen(flagfile.c_str(), "wb");
+        flag.dumpFlagfile(fileno(file));
+        std::fclose(file);
+
+        std::string path2, token2;
+        int port2 = 0;
+        bool debug2 = true;
+        float ratio2 = 0;
+        CXX_OPT_NAMESPACE::Flag rerun;
+        rerun.registerString("path", &path2);
+        rerun.registerString("db.token", &token2);
+        rerun.registerInt("port", &port2);
+        rerun.registerBool("debug", &debug2);
+        rerun.registerFloat("ratio", &ratio2);
+        rerun.parseFlagfile(flagfile);
+        std::remove(flagfile.c_str());
+
+        EXPECT_EQ(path2, path);
+        EXPECT_EQ(token2, token);
+        EXPECT_EQ(port2, port);
+        EXPECT_EQ(debug2, debug);
+        EXPECT_EQ(ratio2, ratio);
+        EXPECT_TRUE(rerun.args().empty());
+    }
+
+    path = "two\nlines";
+    std::string lines;
+    EXPECT_THROW(flag.dumpFlagfile(lines), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+}
+
+TEST(Flag, short_alias) {
+    bool extract = false, verbose = false;
+    std::string file, output;
+    int count = 0;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerBool("extract", &extract);
+    flag.registerBool("verbose", &verbose);
+    flag.registerString("file", &file);
+    flag.registerString("output", &output);
+    flag.registerInt("count", &count);
+    flag.alias('x', "extract");
+    flag.alias('v', "verbose");
+    flag.alias('f', "file");
+    flag.alias('o', "output");
+    flag.alias('n', "count");
+
+    const char *cmd[] = {
+        "./cmd",
+        "-xvf",
+        "archive.tar",
+        "-ofile",
+        "-n12",
+        "a.txt",
+        "-",
+    };
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+
+    EXPECT_TRUE(extract);
+    EXPECT_TRUE(verbose);
+    EXPECT_EQ(file, "archive.tar");
+    EXPECT_EQ(output, "file");
+    EXPECT_EQ(count, 12);
+    ASSERT_EQ(flag.args().size(), 2u);
+    EXPECT_STREQ(flag.arg(1), "-") << "TEST: lone '-' is positional.";
+
+    {
+        GTEST_LOG_(INFO) << "TEST: unknown flag inside a cluster.";
+        const char *bad[] = { "./cmd", "-xq" };
+        EXPECT_THROW(flag.parse(sizeof bad / sizeof bad[0], (char **)&bad), CXX_OPT_NAMESPACE::ParseError);
+    }
+
+    {
+        GTEST_LOG_(INFO) << "TEST: re-registering keeps the alias, unregistering drops it.";
+        std::string file2;
+        flag.registerString("file", &file2);
+        const char *again[] = { "./cmd", "-f", "b.tar" };
+        flag.parse(sizeof again / sizeof again[0], (char **)&again);
+        EXPECT_EQ(file2, "b.tar");
+
+        flag.unregisterFlag("file");
+        flag.parse(sizeof again / sizeof again[0], (char **)&again);
+        EXPECT_EQ(flag.args().size(), 2u);
+    }
+
+    EXPECT_THROW(flag.alias('-', "count"), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+    EXPECT_THROW(flag.alias('z', "missing"), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+}
+
+#ifdef __GLIBC__
+// result of one command line, either parser
+struct GetoptResult {
+    bool extract = false, verbose = false, quiet = false;
+    std::string file = "-", output = "-", name = "-";
+    int count = -1;
+    std::vector<std::string> args;
+
+    bool operator==(const GetoptResult &rhs) const {
+        return extract == rhs.extract && verbose == rhs.verbose && quiet == rhs.quiet &&
+               file == rhs.file && output == rhs.output && name == rhs.name &&
+               count == rhs.count && args == rhs.args;
+    }
+};
+
+static GetoptResult parseWithGetopt(std::vector<std::string> tokens) {
+    static const struct option options[] = {
+        { "extract", no_argument, nullptr, 'x' },
+        { "verbose", no_argument, nullptr, 'v' },
+        { "quiet", no_argument, nullptr, 'q' },
+        { "file", required_argument, nullptr, 'f' },
+        { "output", required_argument, nullptr, 'o' },
+        { "count", required_argument, nullptr, 'n' },
+        { "name", required_argument, nullptr, 'N' },
+        { nullptr, 0, nullptr, 0 },
+    };
+
+    std::vector<char *> argv;
+    argv.push_back((char *)"./cmd");
+    for (auto &token : tokens)
+        argv.push_back(&token[0]);
+    argv.push_back(nullptr);
+
+    GetoptResult result;
+    optind = 0;
+    opterr = 0;
+    for (int c; (c = getopt_long_only(static_cast<int>(argv.size() - 1), argv.data(), "xvf:o:n:", options, nullptr)) != -1;) {
+        switch (c) {
+            case 'x': result.extract = true; break;
+            case 'v': result.verbose = true; break;
+            case 'q': result.quiet = true; break;
+            case 'f': result.file = optarg; break;
+            case 'o': result.output = optarg; break;
+            case 'n': result.count = std::atoi(optarg); break;
+            case 'N': result.name = optarg; break;
+            default: ADD_FAILURE() << "getopt rejected the command line";
+        }
+    }
+    for (int i = optind; i < static_cast<int>(argv.size() - 1); i++)
+        result.args.push_back(argv[i]);
+    return result;
+}
+
+static GetoptResult parseWithFlag(std::vector<std::string> tokens) {
+    GetoptResult result;
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.stopAtDoubleDash();
+    flag.registerBool("extract", &result.extract);
+    flag.registerBool("verbose", &result.verbose);
+    flag.registerBool("quiet", &result.quiet);
+    flag.registerString("file", &result.file);
+    flag.registerString("output", &result.output);
+    flag.registerInt("count", &result.count);
+    flag.registerString("name", &result.name);
+    flag.alias('x', "extract");
+    flag.alias('v', "verbose");
+    flag.alias('f', "file");
+    flag.alias('o', "output");
+    flag.alias('n', "count");
+
+    std::vector<char *> argv;
+    argv.push_back((char *)"./cmd");
+    for (auto &token : tokens)
+        argv.push_back(&token[0]);
+
+    flag.parse(static_cast<int>(argv.size()), argv.data());
+    result.args.assign(flag.args().begin(), flag.args().end());
+    return result;
+}
+
+TEST(Flag, getopt_differential) {
+    const std::vector<std::vector<std::string>> cases = {
+        { "-xvf", "archive.tar", "a.txt" },
+        { "-ofile", "b.txt", "-n5" },
+        { "--file=x", "--output", "y", "c.txt", "--", "-x", "d.txt" },
+        { "-verbose", "-count=3", "e.txt", "--quiet" },
+        { "-xn", "7", "-name", "z", "f.txt" },
+        { "--count", "9", "-f-x", "-", "g.txt" },
+        { "-x", "-v", "-f", "--", "h.txt" },
+        { "i.txt", "-o", "out", "j.txt", "--name=k", "--", "--", "-n1" },
+        { "-vxo=eq", "--extract", "-file", "-o" , "l.txt" },
+    };
+
+    for (const auto &tokens : cases) {
+        GetoptResult expected = parseWithGetopt(tokens);
+        GetoptResult actual = parseWithFlag(tokens);
+        std::string line;
+        for (const auto &token : tokens)
+            line += token + " ";
+        EXPECT_TRUE(expected == actual) << "TEST: " << line;
+    }
+}
+#endif
+
+TEST(Flag, flag_handler) {
+    int calls = 0;
+    std::array<int, 4> capture = {{ 1, 2, 3, 4 }};   // by value, held inline
+    CXX_OPT_NAMESPACE::FlagHandler handler = [&calls, capture](void *ctx) {
+        calls += capture[3];
+        *static_cast<int *>(ctx) += 1;
+    };
+    CXX_OPT_NAMESPACE::FlagHandler copy = handler;
+    capture[3] = 0;
+
+    int context = 0;
+    handler(&context);
+    copy(&context);
+    EXPECT_EQ(calls, 8);
+    EXPECT_EQ(context, 2);
+
+    CXX_OPT_NAMESPACE::FlagHandler empty;
+    EXPECT_TRUE(empty == nullptr);
+    EXPECT_TRUE(CXX_OPT_NAMESPACE::FlagHandler(std::function<void (void *)>()) == nullptr);
+    EXPECT_TRUE(CXX_OPT_NAMESPACE::FlagHandler(static_cast<void (*)(void *)>(nullptr)) == nullptr);
+
+    CXX_OPT_NAMESPACE::Flag flag;
+    EXPECT_THROW(flag.registerHandler("empty", std::function<void (void *)>(), nullptr), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+
+    copy = empty;
+    EXPECT_FALSE(copy);
+    EXPECT_TRUE(static_cast<bool>(handler));
+}
+
+TEST(Flag, handler_order) {
+    const char *cmd[] = {
+        "./cmd",
+        "-late",
+        "-count=3",
+        "-early",
+        "-plain",
+        "-late",
+    };
+
+    std::vector<std::string> trace;
+    int count = 0;
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerInt("count", &count);
+    flag.registerHandler("early", [&](void *) { trace.push_back("early" + std::to_string(count)); }, nullptr, "", CXX_OPT_NAMESPACE::CaseFold::Exact, 10);
+    flag.registerHandler("late", [&](void *) { trace.push_back("late" + std::to_string(count)); }, nullptr, "", CXX_OPT_NAMESPACE::CaseFold::Exact, -10);
+    flag.registerHandler("plain", [&](void *) { trace.push_back("plain" + std::to_string(count)); }, nullptr);
+
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    EXPECT_EQ(trace, std::vector<std::string>({ "late0", "early3", "plain3", "late3" }));
+
+    trace.clear();
+    count = 0;
+    flag.handlerOrder(CXX_OPT_NAMESPACE::HandlerOrder::Argv);
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    EXPECT_EQ(trace, std::vector<std::string>({ "late3", "early3", "plain3", "late3" }));
+
+    trace.clear();
+    flag.handlerOrder(CXX_OPT_NAMESPACE::HandlerOrder::Priority);
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    EXPECT_EQ(trace, std::vector<std::string>({ "early3", "plain3", "late3", "late3" }));
+}
+
+TEST(Flag, handler_deferred_failed_parse) {
+    const char *cmd[] = {
+        "./cmd",
+        "-warmup",
+        "-count=x",
+    };
+
+    bool warmed = false;
+    int count = 0;
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerInt("count", &count);
+    flag.registerHandler("warmup", [](void *ctx) { *static_cast<bool *>(ctx) = true; }, &warmed);
+    flag.handlerOrder(CXX_OPT_NAMESPACE::HandlerOrder::Argv);
+
+    EXPECT_THROW(flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd), CXX_OPT_NAMESPACE::FlagInvalidArgumentError);
+    EXPECT_FALSE(warmed);
+
+    cmd[2] = "-count=1";
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    EXPECT_TRUE(warmed);
+    EXPECT_EQ(count, 1);
+}
+
+TEST(Flag, handler_deferred_reregister) {
+    const char *cmd[] = {
+        "./cmd",
+        "-a",
+        "-b",
+        "-c",
+    };
+
+    std::vector<std::string> trace;
+    CXX_OPT_NAMESPACE::Flag flag;
+    flag.registerHandler("a", [&](void *) {
+            trace.push_back("a");
+            /* plugin reload: b replaced, c removed while queued */
+            flag.registerHandler("b", [&](void *) { trace.push_back("b2"); }, nullptr);
+            flag.unregisterFlag("c");
+        }, nullptr);
+    flag.registerHandler("b", [&](void *) { trace.push_back("b1"); }, nullptr);
+    flag.registerHandler("c", [&](void *) { trace.push_back("c"); }, nullptr);
+    flag.handlerOrder(CXX_OPT_NAMESPACE::HandlerOrder::Argv);
+
+    flag.parse(sizeof cmd / sizeof cmd[0], (char **)&cmd);
+    EXPECT_EQ(trace, std::vector<std::string>({ "a", "b1", "c" })) << "TEST: calls queued by this parse.";
+
+    trace.clear();
+    flag.parse(3, (char **)&cmd);
+    EXPECT_EQ(trace, std::vector<std::string>({ "a", "b2" }));
+}